@@ -0,0 +1,390 @@
+/* File: LOGFORW-KERNELS.C. */
+
+/* Measure the inner loops of the log forward daemon on synthetic data,
+   apart from the files and the target. The daemon is compiled in with
+   its main renamed. */
+
+#define main logforw_main
+#include "logforw.c"
+#undef main
+
+#include <fnmatch.h>
+
+/* Synthetic log size, bytes. */
+#define DATA_SIZE ((size_t) 64 << 20)
+
+/* Passes over the data. */
+#define PASSES 8
+
+/* Synthetic paths to match. */
+#define NPATHS 1000000
+
+/* Bytes handed on by the kernel before forward, kept so the copy is
+   not optimized away. */
+char handed[LINELENGTH_MAX+2+1];
+unsigned long nhanded = 0;
+
+/* Fill a buffer with iRODS like log lines of varying length. Return
+   the number of lines. */
+
+long
+fill_lines (char *data, size_t size)
+{
+	char line[LINELENGTH_MAX];
+	size_t used;
+	long n;
+	int length;
+	int pad;
+
+	used = 0;
+	n = 0;
+	while (true)
+	{
+		pad = (int) ((n * 7919) % 160);
+		length = snprintf (line, sizeof (line),
+			"Oct 17 12:%02ld:%02ld pid:%ld NOTICE: rsApiHandler: "
+			"/tempZone/home/user%03ld/collection/data%06ld.dat %.*s\n",
+			(n / 60) % 60, n % 60, 10000 + n % 5000, n % 1000, n,
+			pad, "................................................"
+			"................................................"
+			"................................................"
+			"................................................");
+		if (used + (size_t) length > size)
+		{
+			break;
+		}
+		(void) memcpy (data + used, line, (size_t) length);
+		used += (size_t) length;
+		n++;
+	}
+	(void) memset (data + used, NL, size - used);
+	return (n + (long) (size - used));
+}
+
+/* Hand a line on as syslog would get it. */
+
+void
+hand (char *line, unsigned long length)
+{
+	(void) memcpy (handed, line, (size_t) length);
+	nhanded += length;
+}
+
+/* The kernel before forward: copy byte by byte, then assemble each
+   line with its file name for syslog. Called with whole lines of at
+   most LINELENGTH_MAX bytes. */
+
+void
+forward_before (char *name, long nbytes, char *buffer)
+{
+	int i;
+	char line[LINELENGTH_MAX+1];
+	char *from;
+	char *to;
+	unsigned long count;
+	char prefixname[PATH_MAX+1];
+	char *syslogprefix;
+	char syslogline[LINELENGTH_MAX+2+1];
+	unsigned long sysloglinelength;
+
+	from = buffer;
+	to = line;
+	*to = EOS;
+	count = 0;
+	for (i=0; i<nbytes; i++)
+	{
+		if (count > (unsigned long) LINELENGTH_MAX)
+		{
+			error ("Line too long");
+		}
+		if (*from == NL)
+		{
+			*to = EOS;
+			prefixname[PATH_MAX] = EOS;
+			(void) strncpy (prefixname, name, PATH_MAX);
+			syslogprefix = basename (prefixname);
+			sysloglinelength = strlen (syslogprefix) + strlen (line) + 2;
+			if (sysloglinelength > LINELENGTH_MAX)
+			{
+				error ("Line way too long");
+			}
+			syslogline[0] = EOS;
+			(void) strcat (syslogline, syslogprefix);
+			(void) strcat (syslogline, ": ");
+			(void) strcat (syslogline, line);
+			hand (syslogline, sysloglinelength);
+			to = line;
+			from++;
+		}
+		else
+		{
+			*to = *from;
+			to++;
+			from++;
+		}
+		count++;
+	}
+}
+
+/* Print a result, the items and the bytes done a second. */
+
+void
+report (char *kernel, char *what, char *items, long n, size_t bytes,
+	unsigned long elapsed)
+{
+	double seconds;
+
+	seconds = (double) elapsed / 1e9;
+	printf ("%-9s %-8s %8.2f M%s/s %6.2f GB/s\n", kernel, what, items,
+		(double) n / seconds / 1e6, (double) bytes / seconds / 1e9);
+}
+
+/* Forward the data in chunks as read from a file, both ways. */
+
+void
+bench_forward (void)
+{
+	char *data;
+	char *p;
+	char *end;
+	char *name;
+	reader_t r;
+	slot_t *slot;
+	long lines;
+	long n;
+	long done;
+	unsigned long start;
+	int pass;
+
+	data = (char *) allocate (DATA_SIZE);
+	lines = fill_lines (data, DATA_SIZE);
+	name = "/var/lib/irods/log/rodsLog.2026.10.17";
+	end = data + DATA_SIZE;
+
+	/* Before, in pieces of whole lines as its caller had to. */
+	start = now_ns ();
+	for (pass=0; pass<PASSES; pass++)
+	{
+		p = data;
+		while (p < end)
+		{
+			n = (long) (end - p);
+			if (n > (long) LINELENGTH_MAX)
+			{
+				n = (long) LINELENGTH_MAX;
+				while (p[n-1] != NL)
+				{
+					n--;
+				}
+			}
+			forward_before (name, n, p);
+			p += n;
+		}
+	}
+	report ("forward", "before", "lines", lines * PASSES,
+		DATA_SIZE * PASSES, now_ns () - start);
+
+	/* After, a reader thread collecting chunks for the sender. The
+	   ring is emptied as it fills, the sending is not measured. */
+	init_counters (1);
+	init_ring ();
+	(void) memset (&r, 0, sizeof (r));
+	r.out = (char *) allocate (SLOT_SIZE);
+	r.prefix = basename (name);
+	r.prefixlength = (int) strlen (r.prefix);
+	r.counters = &counters[0];
+	start = now_ns ();
+	for (pass=0; pass<PASSES; pass++)
+	{
+		p = data;
+		while (p < end)
+		{
+			n = (long) (end - p);
+			if (n > (long) CHUNK_SIZE)
+			{
+				n = (long) CHUNK_SIZE;
+			}
+			done = forward (&r, r.prefix, n, p, false);
+			p += done;
+			while ((slot = get_ring ()) != NULL)
+			{
+				nhanded += slot->used;
+				release_ring (slot);
+			}
+		}
+	}
+	report ("forward", "after", "lines", lines * PASSES,
+		DATA_SIZE * PASSES, now_ns () - start);
+	free (data);
+}
+
+/* Patterns and exclude patterns as given with -p and -x. */
+char *matchpatterns[] =
+{
+	"*/log/rodsLog*",
+	"*/log/reLog*",
+	"*/server/log/*.log",
+	"*/home/*/[a-m]*/*.dat",
+	"*.gz",
+	"*/archive/*",
+	NULL
+};
+
+/* Make an iRODS like path. */
+
+void
+make_path (char *path, size_t size, long i)
+{
+	switch (i % 5)
+	{
+		case 0:
+			(void) snprintf (path, size,
+				"/var/lib/irods/log/rodsLog.2026.%02ld.%02ld%s",
+				i % 12 + 1, i % 28 + 1, (i % 3 == 0) ? ".gz" : "");
+			break;
+		case 1:
+			(void) snprintf (path, size,
+				"/var/lib/irods/log/reLog.2026.%02ld.%02ld",
+				i % 12 + 1, i % 28 + 1);
+			break;
+		case 2:
+			(void) snprintf (path, size,
+				"/var/lib/irods/iRODS/server/log/agent%06ld.log", i);
+			break;
+		case 3:
+			(void) snprintf (path, size,
+				"/tempZone/home/user%03ld/%ccollection/data%06ld.dat",
+				i % 1000, (int) ('a' + i % 26), i);
+			break;
+		default:
+			(void) snprintf (path, size,
+				"/tempZone/archive/user%03ld/data%06ld.dat",
+				i % 1000, i);
+			break;
+	}
+}
+
+/* Match the paths against all the patterns, one fnmatch call for each
+   as before and in one pass of the automaton. */
+
+void
+bench_match (void)
+{
+	char path[PATH_MAX];
+	char **paths;
+	long before;
+	long after;
+	long i;
+	int ids[16];
+	int state;
+	int k;
+	size_t bytes;
+	unsigned long start;
+
+	paths = (char **) allocate (NPATHS * sizeof (char *));
+	bytes = 0;
+	for (i=0; i<NPATHS; i++)
+	{
+		make_path (path, sizeof (path), i);
+		bytes += strlen (path);
+		paths[i] = (char *) allocate (strlen (path) + 1);
+		(void) strcpy (paths[i], path);
+	}
+
+	/* Before. */
+	before = 0;
+	start = now_ns ();
+	for (i=0; i<NPATHS; i++)
+	{
+		for (k=0; matchpatterns[k]!=NULL; k++)
+		{
+			before += (fnmatch (matchpatterns[k], paths[i], 0) == 0);
+		}
+	}
+	report ("match", "before", "paths", NPATHS, bytes, now_ns () - start);
+
+	/* After, the patterns compiled once. */
+	for (k=0; matchpatterns[k]!=NULL; k++)
+	{
+		add_pattern (matchpatterns[k]);
+	}
+	start_matcher ();
+	for (k=0; matchpatterns[k]!=NULL; k++)
+	{
+		ids[k] = pattern_id (matchpatterns[k]);
+	}
+	after = 0;
+	start = now_ns ();
+	for (i=0; i<NPATHS; i++)
+	{
+		state = match_all (paths[i]);
+		for (k=0; matchpatterns[k]!=NULL; k++)
+		{
+			after += matched (state, ids[k]);
+		}
+	}
+	report ("match", "after", "paths", NPATHS, bytes, now_ns () - start);
+	if (after != before)
+	{
+		fprintf (stderr, "Matches differ, %ld before and %ld after\n",
+			before, after);
+		error ("Matcher disagrees with fnmatch");
+	}
+	for (i=0; i<NPATHS; i++)
+	{
+		free (paths[i]);
+	}
+	free (paths);
+}
+
+/* Kernels by name. */
+typedef struct
+{
+	char *name;
+	void (*run) (void);
+} kernel_t;
+
+kernel_t kernels[] =
+{
+	{ "forward", bench_forward },
+	{ "match", bench_match },
+	{ NULL, NULL }
+};
+
+/* Run the kernels asked for, all without arguments. */
+
+int
+main (int argc, char *argv[])
+{
+	int i;
+	int k;
+	int status;
+
+	status = SUCCESS;
+	for (k=0; argc < 2 && kernels[k].name != NULL; k++)
+	{
+		kernels[k].run ();
+	}
+	for (i=1; i<argc; i++)
+	{
+		for (k=0; kernels[k].name != NULL; k++)
+		{
+			if (strcmp (argv[i], kernels[k].name) == 0)
+			{
+				break;
+			}
+		}
+		if (kernels[k].name == NULL)
+		{
+			fprintf (stderr, "No kernel %s\n", argv[i]);
+			status = FAILURE;
+		}
+		else
+		{
+			kernels[k].run ();
+		}
+	}
+	return (status);
+}
+
+/* End of file LOGFORW-KERNELS.C */
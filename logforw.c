@@ -3,17 +3,20 @@
 
 /* Simple program to watch log files and forward changes to syslog. */
 
+/* Use the GNU extensions, statx in particular, when available. */
+#define _GNU_SOURCE
+
 /* System include files. */
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/sysmacros.h>
 #include <sys/time.h>
 #include <fcntl.h>
 #include <string.h>
-#include <regex.h>
-#include <fnmatch.h>
+#include <ctype.h>
 #include <dirent.h>
 #include <errno.h>
 #include <limits.h>
@@ -22,6 +25,25 @@
 #include <libgen.h>
 #include <pwd.h>
 #include <syslog.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/uio.h>
+#include <netdb.h>
+#include <sys/statfs.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <sys/mman.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
 
 /* Status codes. */
 #define FAILURE ((int) 1)
@@ -40,23 +62,21 @@
 /* Sleep delay. */
 #define SLEEP_DELAY 2
 
-/* Regex routines error buffer length. */
-#define ERRBUF_MAX 132
-
-/* Printable representation of the new line character. */
-#define NLPRINT '|'
-
-/* Printable representation of any non-printable character. */
-#define NONPRINT '.'
-
-/* Limit on how much data can arrive during one scan. */
-#define BUFLEN_MAX ((size_t) 2097152)
-
-/* Amount of information to forward to the log. */
+/* Poll intervals of files without change notification, milliseconds.
+   A file found changed is polled every POLL_HOT for HOT_SPAN, then each
+   check not finding a change doubles the interval up to the delay, and
+   up to COLD_FACTOR times the delay once the file has not changed for
+   that long. */
+#define POLL_HOT 100
+#define HOT_SPAN 1000
+#define COLD_FACTOR 30
+
+/* Amount of information to forward to the log. Longer lines are
+   forwarded in pieces. */
 #define LINELENGTH_MAX ((int) 16384)
 
-/* Line length to use to show the first few lines when too long. */
-#define LONG_LINE ((int) 132)
+/* Amount of data read from a file at a time. */
+#define CHUNK_SIZE ((size_t) 65536)
 
 /* Default pattern. */
 #define DEFAULT_PATTERN "*"
@@ -67,6 +87,11 @@
 /* Default facility name. */
 #define DEFAULT_FACILITY "logforw"
 
+/* Output sinks. */
+#define SINK_SYSLOG 0
+#define SINK_DGRAM 1
+#define SINK_STREAM 2
+
 /* Verbose messages. */
 int verbose = false;
 
@@ -82,6 +107,63 @@ char *logfilename = LOG;
 /* Facility name. */
 char *facility = DEFAULT_FACILITY;
 
+/* Facility code. */
+int facilitycode = LOG_LOCAL7;
+
+/* Output sink, the local syslog daemon through syslog(3) by default. */
+int sinktype = SINK_SYSLOG;
+
+/* Output target for the direct transport. */
+char *target = NULL;
+
+/* Message format for the direct transport, RFC 3164 or RFC 5424. */
+int rfcformat = 3164;
+
+/* Use change notification when the file system supports it. */
+int notify = true;
+
+/* Do not descend into other file systems when scanning. */
+int samefs = false;
+
+/* Metrics file, NULL for none, rewritten now and then. */
+char *metricsfile = NULL;
+
+/* Number of reader threads, the files are read by the main thread
+   when there is one. */
+int nworkers = 1;
+
+/* Rate limits per file and for all files, lines and bytes per second,
+   zero when not limited. */
+double filelines = 0.0;
+double filebytes = 0.0;
+double globallines = 0.0;
+double globalbytes = 0.0;
+
+/* Lag in bytes after which lines are dropped instead of delayed, zero
+   to never drop. */
+off_t maxlag = (off_t) 0;
+
+/* Lines dropped and reported so far. */
+unsigned long totaldropped = 0;
+
+/* Lines and bytes forwarded and lines dropped from the files no longer
+   in the catalog. */
+unsigned long pastlines = 0;
+unsigned long pastbytes = 0;
+unsigned long pastdrops = 0;
+
+/* Lines held back by the rate limits, checked again shortly. */
+int throttled = false;
+
+/* Time to report the lines dropped next. */
+time_t droptime = (time_t) 0;
+
+/* Time to wait before checking the files held back, milliseconds. */
+#define THROTTLE_WAIT 100
+
+/* Change notification descriptor, -1 if not in use. */
+int notifyfd = -1;
+
 /* Print error message and quit. */
 
 void
@@ -91,6 +173,10 @@ error (char *msg)
 	exit (FAILURE);
 }
 
+/* Number of allocations made, to confirm that forwarding does not
+   allocate once the buffers are in place. */
+atomic_ulong nallocations = 0;
+
 /* Allocate memory. */
 
 void *
@@ -103,9 +189,45 @@ allocate (size_t s)
 	{
 		error ("Cannot allocate");
 	}
+	nallocations++;
+	return (p);
+}
+
+/* Reallocate memory. */
+
+void *
+reallocate (void *p, size_t s)
+{
+	p = realloc (p, s);
+	if (p == NULL)
+	{
+		error ("Cannot allocate");
+	}
+	nallocations++;
 	return (p);
 }
 
+/* Make sure a reusable buffer holds at least the size needed. The
+   buffer grows to the next power of two and is never cleared. */
+
+char *
+reserve (char **buffer, size_t *size, size_t needed)
+{
+	size_t n;
+
+	if (*size < needed)
+	{
+		n = (*size == 0) ? (size_t) 4096 : *size;
+		while (n < needed)
+		{
+			n *= 2;
+		}
+		*buffer = (char *) reallocate (*buffer, n);
+		*size = n;
+	}
+	return (*buffer);
+}
+
 /* Macro to allocate memory. */
 
 #define new(type) ((type *) allocate (sizeof (type)))
@@ -118,102 +240,133 @@ eqs (char *s1, char *s2)
 	return (strcmp (s1, s2) == 0);
 }
 
-/* Match string to filename pattern. */
+/* Time from a monotonic clock in nanoseconds. */
 
-int
-match (char *pattern, char *string)
+unsigned long
+now_ns (void)
 {
-	int status;
+	struct timespec ts;
 
-	if (pattern == NULL)
-	{
+	(void) clock_gettime (CLOCK_MONOTONIC, &ts);
+	return ((unsigned long) ts.tv_sec * 1000000000UL +
+		(unsigned long) ts.tv_nsec);
+}
 
-		/* Return early with success. */
-		return (true);
-	}
+/* Time from a monotonic clock in milliseconds. */
 
-	status = fnmatch (pattern, string, 0);
-	if (status == 0)
-	{
-		return (true);
-	}
-	else if (status == FNM_NOMATCH)
-	{
-		return (false);
-	}
-	else
-	{
-		(void) fprintf (stderr, "Pattern is '%s'\n", pattern);
-		(void) fprintf (stderr, "String is '%s'\n", string);
-		(void) fprintf (stderr, "Status is '%d'\n", status);
-		error ("Function fnmatch failed");
-	}
+unsigned long
+now_ms (void)
+{
+	return (now_ns () / 1000000UL);
 }
 
-/* Match string to regular expression. */
+/* Counters for the metrics. Each thread counting has a set of its own
+   on cache lines of its own, the main thread the first, so the threads
+   do not contend. A counter is only written by its thread, with a plain
+   load and store, and the sets are summed when the metrics are read. */
+#define CACHE_LINE 64
 
-int
-regmatch (char *pattern, char *string)
+/* Bounds of the send latency buckets, nanoseconds. */
+#define LATENCY_BUCKETS 6
+unsigned long latencybounds[LATENCY_BUCKETS] =
 {
-	int status;
-	regex_t re;
-	char errbuf[ERRBUF_MAX];
+	100000UL, 1000000UL, 10000000UL, 100000000UL, 1000000000UL,
+	10000000000UL
+};
 
-	if (pattern == NULL)
-	{
+/* Counters of a thread. */
+typedef struct
+{
 
-		/* No pattern, return immediately. */
-		return (true);
-	}
+	/* Lines and bytes forwarded. */
+	_Alignas (CACHE_LINE) atomic_ulong lines;
+	atomic_ulong bytes;
 
-	/* Compile regular expression. */
-	status = regcomp (&re, pattern, REG_EXTENDED|REG_NOSUB);
-	if (status != 0)
-	{
-		(void) fprintf (stderr, "Regular expression is '%s'\n", pattern);
-		(void) fprintf (stderr, "String is '%s'\n", string);
-		(void) regerror (status, &re, errbuf, (size_t) ERRBUF_MAX);
-		(void) fprintf (stderr, "Regexp error %s\n", errbuf);
-		perror ("Error context");
-		error ("Error compiling regular expression");
-	}
+	/* Pieces of lines too long forwarded apart, and lines dropped
+	   lagging behind. */
+	atomic_ulong split;
+	atomic_ulong dropped;
 
-	/* Compare and free. */
-	status = regexec (&re, string, (size_t) 0, NULL, 0);
-	regfree (&re);
+	/* Sends to the target or to syslog by latency bucket, the last for
+	   the slower ones, and the time they took, nanoseconds. */
+	atomic_ulong sends[LATENCY_BUCKETS + 1];
+	atomic_ulong sendtime;
 
-	/* Return accordingly. */
-	if (status == 0)
-	{
-		return (true);
-	}
-	else if (status == REG_NOMATCH)
+	/* Directories read again and the time it took, nanoseconds. */
+	atomic_ulong rescans;
+	atomic_ulong rescantime;
+} counters_t;
+
+/* Counter sets. */
+counters_t *counters = NULL;
+int ncounters = 0;
+
+/* Time the scan at startup took, nanoseconds. */
+unsigned long scantime = 0;
+
+/* Allocate the counter sets for the threads. */
+
+void
+init_counters (int n)
+{
+	int i;
+
+	if (posix_memalign ((void **) &counters, (size_t) CACHE_LINE,
+		(size_t) n * sizeof (counters_t)) != 0)
 	{
-		return (false);
+		error ("Cannot allocate");
 	}
-	else
+	(void) memset (counters, 0, (size_t) n * sizeof (counters_t));
+	for (i=0; i<n; i++)
 	{
-		(void) fprintf (stderr, "Matching with string %s\n", pattern);
-		error ("Regular expression matching failure\n");
+		atomic_init (&counters[i].lines, 0UL);
 	}
+	ncounters = n;
 }
 
-/* Delay. */
+/* Add to a counter of the thread. */
 
 void
-delay (int seconds)
+add_count (atomic_ulong *c, unsigned long n)
 {
-	unsigned int sleep_status;
+	atomic_store_explicit (c,
+		atomic_load_explicit (c, memory_order_relaxed) + n,
+		memory_order_relaxed);
+}
+
+/* Sum of a counter over the threads, by its offset in the set. */
+
+unsigned long
+sum_counters (size_t field)
+{
+	unsigned long sum;
+	int i;
 
-	if (seconds == 0)
+	sum = 0;
+	for (i=0; i<ncounters; i++)
 	{
-		error ("Invalid argument to sleep");
+		sum += atomic_load_explicit (
+			(atomic_ulong *) ((char *) &counters[i] + field),
+			memory_order_relaxed);
 	}
-	sleep_status = sleep ((unsigned int) seconds);
-	if (sleep_status != (unsigned int) 0)
+	return (sum);
+}
+
+/* Count a send started at the time given, nanoseconds. Sends are made
+   by the main thread. */
+
+void
+count_send (unsigned long start)
+{
+	unsigned long took;
+	int i;
+
+	took = now_ns () - start;
+	for (i=0; i<LATENCY_BUCKETS && took > latencybounds[i]; i++)
 	{
-		error ("Error returned by sleep");
 	}
+	add_count (&counters[0].sends[i], 1UL);
+	add_count (&counters[0].sendtime, took);
 }
 
 /* Check if it is a directory. */
@@ -236,869 +389,6932 @@ directory (char *path)
 	return (S_ISDIR (s.st_mode));
 }
 
-/* Check if it is a real name. */
-
-int
-realname (char *path)
-{
-	char *start;
-	char *end;
-	char *p;
-	char ch;
-
-	/* Scan path in reverse. Stop at slash or at start. */
-	start = path;
-	end = path + strlen (path);
-	p = end;
-	ch = *p;
-	while (p != start)
-	{
-		if (ch == '/')
-		{
-			p++;
-			break;
-		}
-		p--;
-		ch = *p;
-	}
-
-	/* Return whether the name was not dot or dot-dot. */
-	return (! ((strcmp (p, ".") == 0) || (strcmp (p, "..") == 0)));
-}
-
-/* File catalog is an array of file descriptors. */
-
-/* File descriptor. */
+/* Index. Open addressing with linear probing maps keys, such as names,
+   to entry numbers in a table. The keys themselves are kept by the table. */
 typedef struct
 {
 
-	/* Sequence number. */
-	int sn;
+	/* Entry numbers, -1 if the slot is empty. */
+	int *slots;
 
-	/* File name. */
-	char *name;
+	/* Hash values of the keys in the slots. */
+	unsigned long *hashes;
 
-	/* File descriptor. */
-	int fd;
+	/* Number of slots, a power of two. */
+	unsigned long size;
 
-	/* Status buffers, last and current. */
-	struct stat *laststatbuf;
-	struct stat *statbuf;
+	/* Number of slots used. */
+	unsigned long used;
 
-	/* Modified times, last and current. */
-	time_t lastmodified;
-	time_t modified;
+	/* Check if the entry by number has the key. */
+	int (*same) (int, void *);
+} index_t;
 
-	/* End offset positions of the file, last and current. */
-	off_t lastendpos;
-	off_t endpos;
-} file_t;
+/* Initial number of slots in an index. */
+#define INDEX_MIN 1024
 
-/* Maximum number of entries in file catalog. */
-#define FILES_MAX 8192
+/* Hash name, FNV-1a. */
 
-/* Number of files in the catalog. */
-int nfiles = 0;
+unsigned long
+hash_name (char *name)
+{
+	unsigned long h;
+	unsigned char *p;
 
-/* File catalog. */
-file_t *files[FILES_MAX];
+	h = 14695981039346656037UL;
+	for (p=(unsigned char *) name; *p!=EOS; p++)
+	{
+		h ^= (unsigned long) *p;
+		h *= 1099511628211UL;
+	}
+	return (h);
+}
 
-/* Print configuration. */
+/* Hash bytes. */
 
-void
-print_configuration (void)
+unsigned long
+hash_bytes (char *bytes, size_t length)
 {
-	if (verbose)
-	{
-		printf ("Verbose on\n");
-	}
-	if (! background)
+	unsigned long h;
+	size_t i;
+
+	h = 14695981039346656037UL;
+	for (i=0; i<length; i++)
 	{
-		printf ("Debug on\n");
+		h ^= (unsigned long) (unsigned char) bytes[i];
+		h *= 1099511628211UL;
 	}
-	printf ("Delay in main daemon loop %d\n", delayseconds);
-	printf ("Data limit on data during a scan is %lu\n",
-		(unsigned long) BUFLEN_MAX);
-	printf ("Maximum amount to forward to the log is %d\n", LINELENGTH_MAX);
-	printf ("Line length to show sample buffer is %d\n", LONG_LINE);
-	printf ("File table size is %d\n", FILES_MAX);
-	printf ("Facility is %s\n", facility);
-	printf ("Log file name is %s\n", logfilename);
+	return (h);
 }
 
-/* Initialize file catalog. */
+/* Hash device and inode numbers. */
 
-void
-init_file (void)
+unsigned long
+hash_inode (dev_t dev, ino_t ino)
 {
-	int i;
-	file_t *f;
+	unsigned long h;
 
-	if (verbose)
+	h = ((unsigned long) dev * 0x9e3779b97f4a7c15UL) ^ (unsigned long) ino;
+	h ^= h >> 29;
+	h *= 0xbf58476d1ce4e5b9UL;
+	h ^= h >> 32;
+	return (h);
+}
+
+/* Find the slot of a key in the index, -1 if not there. */
+
+long
+index_slot (index_t *ix, void *key, unsigned long h)
+{
+	unsigned long mask;
+	unsigned long i;
+
+	if (ix->size == 0)
 	{
-		printf ("Initializing file table with %d entries\n", FILES_MAX);
+		return (-1L);
 	}
-	for (i=0; i<FILES_MAX; i++)
+	mask = ix->size - 1;
+	for (i=h&mask; ix->slots[i]!=-1; i=(i+1)&mask)
 	{
-		files[i] = NULL;
+		if (ix->hashes[i] == h && ix->same (ix->slots[i], key))
+		{
+			return ((long) i);
+		}
 	}
+	return (-1L);
 }
 
-/* Print status block. */
+/* Get entry number by key from the index, -1 if not there. */
 
-void
-print_statbuf (struct stat *st)
+int
+index_get (index_t *ix, void *key, unsigned long h)
 {
-	printf ("%40s: %ld\n", "Device id", (long) st->st_dev);
-	printf ("%40s: %ld\n", "Inode number", (long) st->st_ino);
-	printf ("%40s: %lo\n", "Access mode", (unsigned long) st->st_mode);
-	printf ("%40s: %ld\n", "Number of links", (long) st->st_nlink);
-	printf ("%40s: %ld\n", "Uid", (long) st->st_uid);
-	printf ("%40s: %ld\n", "Gid", (long) st->st_gid);
-	printf ("%40s: %ld\n", "Special device id", (long) st->st_rdev);
-	printf ("%40s: %lld\n", "Size", (long long) st->st_size);
-	printf ("%40s: %lld\n", "Block size", (long long) st->st_blksize);
-	printf ("%40s: %lld\n", "Blocks allocated", (long long) st->st_blocks);
-	printf ("%40s: %s", "Status change", ctime (&st->st_ctime));
-	printf ("%40s: %s", "Access", ctime (&st->st_atime));
-	printf ("%40s: %s", "Modification", ctime (&st->st_mtime));
+	long i;
+
+	i = index_slot (ix, key, h);
+	return ((i == -1L) ? -1 : ix->slots[i]);
 }
 
-/* Print file. */
+/* Insert into slots without checking for duplicates or space. */
 
 void
-print_file (file_t *f)
+index_insert (index_t *ix, unsigned long h, int n)
 {
-	printf ("%40s: %d\n", "Sequence number", f->sn);
-	printf ("%40s: %s\n", "File name", f->name);
-	printf ("%40s: %d\n", "File descriptor number", f->fd);
-	print_statbuf (f->laststatbuf);
-	print_statbuf (f->statbuf);
-	printf ("%40s: %s", "Last modification time", ctime (&f->lastmodified));
-	printf ("%40s: %s", "Current modification time", ctime (&f->modified));
-	printf ("%40s: %lld\n", "Last end position", (long long) f->lastendpos);
-	printf ("%40s: %lld\n", "Current end position", (long long) f->endpos);
+	unsigned long mask;
+	unsigned long i;
+
+	mask = ix->size - 1;
+	for (i=h&mask; ix->slots[i]!=-1; i=(i+1)&mask)
+	{
+		;
+	}
+	ix->slots[i] = n;
+	ix->hashes[i] = h;
+	ix->used++;
 }
 
-/* Print file catalog. */
+/* Put entry number with the hash of its key into the index. */
 
 void
-print_catalog (void)
+index_put (index_t *ix, unsigned long h, int n)
 {
-	int i;
+	int *oldslots;
+	unsigned long *oldhashes;
+	unsigned long oldsize;
+	unsigned long i;
 
-	for (i=0; i<FILES_MAX; i++)
+	/* Grow to keep the load at most half. */
+	if ((ix->used + 1) * 2 > ix->size)
 	{
-		if (files[i] != NULL)
+		oldslots = ix->slots;
+		oldhashes = ix->hashes;
+		oldsize = ix->size;
+		ix->size = (oldsize == 0) ? INDEX_MIN : oldsize * 2;
+		ix->slots = (int *) allocate (ix->size * sizeof (int));
+		ix->hashes = (unsigned long *) allocate (ix->size *
+			sizeof (unsigned long));
+		for (i=0; i<ix->size; i++)
 		{
-			if (files[i]->sn != -1)
+			ix->slots[i] = -1;
+		}
+		ix->used = 0;
+		for (i=0; i<oldsize; i++)
+		{
+			if (oldslots[i] != -1)
 			{
-				printf ("\n");
-				print_file (files[i]);
+				index_insert (ix, oldhashes[i], oldslots[i]);
 			}
 		}
+		if (oldslots != NULL)
+		{
+			free (oldslots);
+			free (oldhashes);
+		}
 	}
+	index_insert (ix, h, n);
 }
 
-/* Get file from the catalog. */
+/* Remove entry number with the hash of its key from the index. Later
+   entries of the probe sequence are shifted back so that no deleted
+   markers are needed. */
 
-file_t *
-get_file (char *name)
+void
+index_remove (index_t *ix, unsigned long h, int n)
 {
-	file_t *f;
-	int i;
+	unsigned long mask;
+	unsigned long i;
+	unsigned long j;
+	unsigned long k;
 
-	f = NULL;
-	for (i=0; i<FILES_MAX; i++)
+	if (ix->size == 0)
+	{
+		return;
+	}
+	mask = ix->size - 1;
+	for (i=h&mask; ix->slots[i]!=n; i=(i+1)&mask)
 	{
-		f = files[i];
-		if (f != NULL)
+		if (ix->slots[i] == -1)
 		{
-			if (f->sn != -1)
-			{
-				if (strcmp (f->name, name) == 0)
-				{
-					break;
-				}
-			}
+			return;
+		}
+	}
+	ix->slots[i] = -1;
+	ix->used--;
+	for (j=(i+1)&mask; ix->slots[j]!=-1; j=(j+1)&mask)
+	{
+
+		/* Home slot of the entry, move it if the hole is on its way. */
+		k = ix->hashes[j] & mask;
+		if ((j > i && (k <= i || k > j)) || (j < i && (k <= i && k > j)))
+		{
+			ix->slots[i] = ix->slots[j];
+			ix->hashes[i] = ix->hashes[j];
+			ix->slots[j] = -1;
+			i = j;
 		}
 	}
-	return (f);
 }
 
-/* Put file into the catalog. */
+/* Free the slots of an index, it is empty afterwards. */
 
 void
-put_file (char *name)
+index_free (index_t *ix)
 {
-	file_t *f;
-	int found;
-	int i;
-	int fd;
-	int status;
-	off_t filepos;
-
-	/* Check if we got the file already. */
-	f = get_file (name);
-
-	/* If found there is not much to do, otherwise add it. */
-	if (f == NULL)
+	if (ix->slots != NULL)
 	{
+		free (ix->slots);
+		free (ix->hashes);
+	}
+	ix->slots = NULL;
+	ix->hashes = NULL;
+	ix->size = 0;
+	ix->used = 0;
+}
 
-		/* Print message. */
-		if (verbose)
-		{
-			printf ("Registering %s\n", name);
-		}
+/* Pattern matcher. All the patterns given are compiled together into
+   one automaton, so a name is matched against all of them in a single
+   pass. The patterns have the syntax of fnmatch(3) without flags, each
+   is a sequence of tokens and a position in it is a state. The sets of
+   states reached are cached as the states of a deterministic automaton
+   with the transitions filled in as they are taken. */
+
+/* Token types. */
+#define T_CHAR 0
+#define T_ANY 1
+#define T_STAR 2
+#define T_SET 3
+#define T_END 4
+
+/* Token, the characters a bracket expression matches in a bit map. */
+typedef struct
+{
+	int type;
+	unsigned char c;
+	unsigned char set[32];
+} token_t;
+
+/* Tokens of all patterns, each one ends in T_END. */
+token_t *tokens = NULL;
+int ntokens = 0;
+
+/* Patterns and the position of their end. */
+char **patterns = NULL;
+int *patternends = NULL;
+int npatterns = 0;
+
+/* State of the deterministic automaton, the set of token positions and
+   the states following for each character, -1 if not known yet. */
+typedef struct
+{
+	unsigned long *set;
+	int next[256];
+} dstate_t;
 
-		/* Find first empty slot. */
-		found = false;
-		for (i=0; i<FILES_MAX; i++)
-		{
-			f = files[i];
-			if (f == NULL)
-			{
+/* Most states cached, the cache is emptied when exceeded. */
+#define DSTATES_MAX 1024
 
-				/* Unallocated fresh. */
-				files[i] = new (file_t);
-				f = files[i];
-				found = true;
-				break;
-			}
-			if (f->sn == -1)
-			{
+/* States cached, the first one is the start. */
+dstate_t *dstates = NULL;
+int ndstates = 0;
+int dstatessize = 0;
 
-				/* Used before but free. */
-				found = true;
-				break;
-			}
-		}
-		if (found == false)
-		{
+/* Words in a set of positions. */
+int nwords = 0;
 
-			/* No empty slots. */
-			error ("File catalog is full");
-		}
+/* Set being built. */
+unsigned long *nextset = NULL;
 
-		/* Fill new slot. */
-		f->sn = i;
-		f->name = strdup (name);
+/* Compare state with a set of positions. */
 
-		/* Open file. */
-		fd = open (name, O_RDONLY);
-		if (fd == -1)
-		{
-			fprintf (stderr, "Error opening %s\n", name);
-			perror ("Error context");
-			error ("Cannot open file");
-		}
-		f->fd = fd;
+int
+dstate_same (int n, void *key)
+{
+	return (memcmp (dstates[n].set, key,
+		(size_t) nwords * sizeof (unsigned long)) == 0);
+}
 
-		/* Create  and fill last and current status blocks. */
-		f->laststatbuf = new (struct stat);
-		(void) memset (f->laststatbuf, 0, sizeof (struct stat));
-		f->statbuf = new (struct stat);
-		(void) memset (f->statbuf, 0, sizeof (struct stat));
-		status = fstat (fd, f->statbuf);
-		if (status == -1)
-		{
-			fprintf (stderr, "Error calling stat for %s\n", name);
-			perror ("Error context");
-			error ("Cannot stat file");
-		}
-		(void) memcpy (f->laststatbuf, f->statbuf, sizeof (struct stat));
+/* States by their set of positions. */
+index_t dstateindex = {NULL, NULL, 0, 0, dstate_same};
 
-		/* Get last and current modification dates. */
-		f->lastmodified = f->statbuf->st_mtime;
-		f->modified = f->lastmodified;
+/* Hash set of positions, FNV-1a over the words. */
 
-		/* Get last and current end of file offset. */
-		filepos = lseek (fd, (off_t) 0, SEEK_END);
-		if (filepos == (off_t) -1)
-		{
-			fprintf (stderr, "Error seeking %s\n", f->name);
-			perror ("Error context");
-			error ("Cannot seek");
-		}
-		f->lastendpos = filepos;
-		f->endpos = f->lastendpos;
+unsigned long
+hash_set (unsigned long *set)
+{
+	unsigned long h;
+	int i;
 
-		/* Close file. */
-		status = close (fd);
-		if (status == -1)
-		{
-			fprintf (stderr, "Error closing %s\n", f->name);
-			perror ("Error context");
-			error ("Cannot close");
-		}
-		f->fd = -1;
+	h = 14695981039346656037UL;
+	for (i=0; i<nwords; i++)
+	{
+		h ^= set[i];
+		h *= 1099511628211UL;
 	}
-	nfiles++;
+	return (h);
 }
 
-/* Remove file entry from the catalog. */
+/* Add token. */
 
-void
-remove_entry (int n)
+token_t *
+add_token (int type)
 {
-	file_t *f;
+	token_t *t;
 
-	/* File is by the number. */
-	f = files[n];
+	tokens = (token_t *) reallocate (tokens, (ntokens + 1) * sizeof (token_t));
+	t = &tokens[ntokens++];
+	(void) memset (t, 0, sizeof (token_t));
+	t->type = type;
+	return (t);
+}
+
+/* Compile one character of a bracket expression, escaped, a collating
+   symbol [.c.] or an equivalence class [=c=] of one character or a
+   plain one. Return it and move past it, -1 if the pattern is invalid. */
+
+int
+set_element (char **pp)
+{
+	char *p;
+	int c;
+
+	p = *pp;
+	if (p[0] == '\\')
+	{
+		if (p[1] == EOS)
+		{
+			return (-1);
+		}
+		*pp = p + 2;
+		return ((unsigned char) p[1]);
+	}
+	if (p[0] == '[' && p[1] == '.')
+	{
+		if (p[2] == EOS || p[3] != '.' || p[4] != ']')
+		{
+			return (-1);
+		}
+		*pp = p + 5;
+		return ((unsigned char) p[2]);
+	}
+	if (p[0] == '[' && p[1] == '=' && p[2] != EOS && p[3] == '=' &&
+		p[4] == ']')
+	{
+		*pp = p + 5;
+		return ((unsigned char) p[2]);
+	}
+	c = (unsigned char) *p;
+	*pp = p + 1;
+	return (c);
+}
+
+/* Find the end of a bracket expression the way fnmatch passes over the
+   rest of it once a character was found, taking the elements in
+   brackets as wholes. Return the ']' or the end of the pattern, NULL if
+   fnmatch fails on the way. */
+
+char *
+skip_set (char *p)
+{
+	char *end;
+
+	while (*p != ']' && *p != EOS)
+	{
+		if (p[0] == '\\')
+		{
+			if (p[1] == EOS)
+			{
+				return (NULL);
+			}
+			p += 2;
+		}
+		else if (p[0] == '[' && p[1] == ':')
+		{
+			for (end=p+2; *end>='a' && *end<='z'; end++)
+			{
+			}
+			p = (end[0] == ':' && end[1] == ']') ? end + 2 : p + 1;
+		}
+		else if (p[0] == '[' && p[1] == '=')
+		{
+			if (p[2] == EOS || p[3] != '=' || p[4] != ']')
+			{
+				return (NULL);
+			}
+			p += 5;
+		}
+		else if (p[0] == '[' && p[1] == '.')
+		{
+			end = strstr (p + 2, ".]");
+			if (end == NULL)
+			{
+				return (NULL);
+			}
+			p = end + 2;
+		}
+		else
+		{
+			p++;
+		}
+	}
+	return (p);
+}
+
+/* Compile bracket expression starting after the '['. Return the end
+   after the ']', NULL if there is none and the '[' is a character. A
+   bracket expression fnmatch finds invalid leaves an empty set, which
+   matches nothing, and the end of the pattern is returned. */
+
+char *
+compile_set (token_t *t, char *p)
+{
+	static struct
+	{
+		char *name;
+		int (*is) (int);
+	} classes[] =
+	{
+		{"alnum", isalnum}, {"alpha", isalpha}, {"blank", isblank},
+		{"cntrl", iscntrl}, {"digit", isdigit}, {"graph", isgraph},
+		{"lower", islower}, {"print", isprint}, {"punct", ispunct},
+		{"space", isspace}, {"upper", isupper}, {"xdigit", isxdigit},
+		{NULL, NULL}
+	};
+	unsigned char set[32];
+	unsigned char rejected[32];
+	int lo;
+	int hi;
+	int negate;
+	int first;
+	int fatal;
+	int c;
+	int i;
+	char *start;
+	char *end;
+
+	(void) memset (set, 0, sizeof (set));
+	(void) memset (rejected, 0, sizeof (rejected));
+	(void) memset (t->set, 0, sizeof (t->set));
+	negate = (*p == '!' || *p == '^');
+	if (negate)
+	{
+		p++;
+	}
+	first = true;
+	fatal = false;
+	while ((*p != ']' || first) && *p != EOS && ! fatal)
+	{
+		first = false;
+		start = p;
+
+		/* Character class, a name in lower case letters. */
+		if (p[0] == '[' && p[1] == ':')
+		{
+			for (end=p+2; *end>='a' && *end<='z'; end++)
+			{
+			}
+			if (end[0] == ':' && end[1] == ']')
+			{
+				for (i=0; classes[i].name!=NULL; i++)
+				{
+					if ((size_t) (end - p - 2) == strlen (classes[i].name) &&
+						strncmp (p + 2, classes[i].name, end - p - 2) == 0)
+					{
+						break;
+					}
+				}
+				if (classes[i].name == NULL)
+				{
+					fatal = true;
+					continue;
+				}
+				for (c=0; c<256; c++)
+				{
+					if (classes[i].is (c))
+					{
+						set[c/8] |= 1 << (c%8);
+					}
+				}
+				p = end + 2;
+				continue;
+			}
+		}
+
+		/* An equivalence class not well formed is taken as a '[', but
+		   fnmatch fails a character found before it. */
+		if (p[0] == '[' && p[1] == '=' &&
+			! (p[2] != EOS && p[3] == '=' && p[4] == ']'))
+		{
+			for (i=0; i<32; i++)
+			{
+				rejected[i] |= set[i];
+			}
+		}
+
+		/* Character or range. */
+		lo = set_element (&p);
+		hi = lo;
+		if (lo != -1 && p[0] == '-' && p[1] != ']')
+		{
+			p++;
+			hi = (*p == EOS) ? -1 : set_element (&p);
+		}
+		if (lo == -1 || hi == -1)
+		{
+			fatal = true;
+			p = start;
+			continue;
+		}
+		for (c=lo; c<=hi; c++)
+		{
+			set[c/8] |= 1 << (c%8);
+		}
+	}
+
+	/* Where fnmatch finds the expression invalid only the characters
+	   found before match, up to the end it finds passing over the rest,
+	   and none if it fails there. */
+	if (fatal)
+	{
+		end = skip_set (p);
+		if (end == NULL)
+		{
+			return (p + strlen (p));
+		}
+		p = end;
+	}
+
+	/* Without an end the '[' is a character, unless fnmatch fails it. */
+	if (*p == EOS)
+	{
+		if ((rejected['['/8] & (1 << ('['%8))) ||
+			(fatal && ! (set['['/8] & (1 << ('['%8)))))
+		{
+			return (p);
+		}
+		return (NULL);
+	}
+	for (i=0; i<32; i++)
+	{
+		if (negate)
+		{
+			t->set[i] = fatal ? 0 : ~set[i];
+		}
+		else
+		{
+			t->set[i] = set[i] & ~rejected[i];
+		}
+	}
+	return (p + 1);
+}
+
+/* Compile pattern into tokens. */
+
+void
+compile_pattern (char *pattern)
+{
+	token_t *t;
+	token_t set;
+	char *p;
+	char *end;
+
+	p = pattern;
+	while (*p != EOS)
+	{
+		if (*p == '*')
+		{
+			(void) add_token (T_STAR);
+			p++;
+		}
+		else if (*p == '?')
+		{
+			(void) add_token (T_ANY);
+			p++;
+		}
+		else if (*p == '[' && (end = compile_set (&set, p + 1)) != NULL)
+		{
+			t = add_token (T_SET);
+			(void) memcpy (t->set, set.set, sizeof (t->set));
+			p = end;
+		}
+		else if (*p == '\\' && p[1] == EOS)
+		{
+
+			/* A trailing backslash makes the pattern invalid, it matches
+			   nothing as with fnmatch. */
+			(void) add_token (T_SET);
+			p++;
+		}
+		else
+		{
+			if (*p == '\\')
+			{
+				p++;
+			}
+			t = add_token (T_CHAR);
+			t->c = (unsigned char) *p++;
+		}
+	}
+	(void) add_token (T_END);
+}
+
+/* Follow the stars, a position before one also reaches the next. */
+
+void
+closure (unsigned long *set)
+{
+	int p;
+
+	for (p=0; p<ntokens; p++)
+	{
+		if ((set[p/64] & (1UL << (p%64))) && tokens[p].type == T_STAR)
+		{
+			set[(p+1)/64] |= 1UL << ((p+1)%64);
+		}
+	}
+}
+
+/* Get the state for the set of positions, added if new. */
+
+int
+get_dstate (unsigned long *set)
+{
+	unsigned long h;
+	int n;
+	int c;
+
+	h = hash_set (set);
+	n = index_get (&dstateindex, set, h);
+	if (n != -1)
+	{
+		return (n);
+	}
+	if (ndstates == dstatessize)
+	{
+		dstatessize = (dstatessize == 0) ? 64 : dstatessize * 2;
+		dstates = (dstate_t *) reallocate (dstates,
+			dstatessize * sizeof (dstate_t));
+	}
+	n = ndstates++;
+	dstates[n].set = (unsigned long *) allocate ((size_t) nwords *
+		sizeof (unsigned long));
+	(void) memcpy (dstates[n].set, set, (size_t) nwords *
+		sizeof (unsigned long));
+	for (c=0; c<256; c++)
+	{
+		dstates[n].next[c] = -1;
+	}
+	index_put (&dstateindex, h, n);
+	return (n);
+}
+
+/* Empty the cache of states, only the start state is put back. */
+
+void
+reset_dstates (void)
+{
+	int i;
+
+	for (i=0; i<ndstates; i++)
+	{
+		free (dstates[i].set);
+	}
+	ndstates = 0;
+	index_free (&dstateindex);
+	(void) memset (nextset, 0, (size_t) nwords * sizeof (unsigned long));
+	for (i=0; i<npatterns; i++)
+	{
+		nextset[(i == 0 ? 0 : patternends[i-1] + 1) / 64] |=
+			1UL << ((i == 0 ? 0 : patternends[i-1] + 1) % 64);
+	}
+	closure (nextset);
+	(void) get_dstate (nextset);
+}
+
+/* Get the number of a pattern, -1 if it is not compiled. */
+
+int
+find_pattern (char *pattern)
+{
+	int i;
+
+	for (i=0; i<npatterns; i++)
+	{
+		if (patterns[i] == pattern || eqs (patterns[i], pattern))
+		{
+			return (i);
+		}
+	}
+	return (-1);
+}
+
+/* Compile pattern into the automaton unless it is there. */
+
+void
+add_pattern (char *pattern)
+{
+	if (find_pattern (pattern) != -1)
+	{
+		return;
+	}
+	patterns = (char **) reallocate (patterns,
+		(npatterns + 1) * sizeof (char *));
+	patternends = (int *) reallocate (patternends,
+		(npatterns + 1) * sizeof (int));
+	patterns[npatterns] = (char *) allocate (strlen (pattern) + 1);
+	(void) strcpy (patterns[npatterns], pattern);
+	compile_pattern (pattern);
+	patternends[npatterns] = ntokens - 1;
+	npatterns++;
+}
+
+/* Start the cache of states over the patterns compiled. */
+
+void
+start_matcher (void)
+{
+	nwords = (ntokens + 64) / 64;
+	nextset = (unsigned long *) reallocate (nextset, (size_t) nwords *
+		sizeof (unsigned long));
+	reset_dstates ();
+}
+
+/* Compile the default pattern and all the patterns and exclude patterns
+   on the command line, before the scan that matches against them. */
+
+void
+compile_patterns (int argc, char *argv[])
+{
+	int i;
+
+	add_pattern (DEFAULT_PATTERN);
+	for (i=1; i<argc-1; i++)
+	{
+		if (argv[i] != NULL && (eqs (argv[i], "-p") ||
+			eqs (argv[i], "--pattern") || eqs (argv[i], "-x") ||
+			eqs (argv[i], "--exclude")))
+		{
+			i++;
+			if (argv[i] != NULL && *argv[i] != EOS)
+			{
+				add_pattern (argv[i]);
+			}
+		}
+	}
+	start_matcher ();
+}
+
+/* Get the number of a compiled pattern. */
+
+int
+pattern_id (char *pattern)
+{
+	int id;
+
+	id = find_pattern (pattern);
+	if (id == -1)
+	{
+		error ("Pattern not compiled");
+	}
+	return (id);
+}
+
+/* Match name against all patterns. Return the final state. */
+
+int
+match_all (char *name)
+{
+	unsigned char *s;
+	unsigned long *set;
+	int n;
+	int next;
+	int p;
+
+	if (ndstates > DSTATES_MAX)
+	{
+		reset_dstates ();
+	}
+	n = 0;
+	for (s=(unsigned char *) name; *s!=EOS; s++)
+	{
+		next = dstates[n].next[*s];
+		if (next == -1)
+		{
+
+			/* Not taken before, step all the positions. */
+			set = dstates[n].set;
+			(void) memset (nextset, 0, (size_t) nwords *
+				sizeof (unsigned long));
+			for (p=0; p<ntokens; p++)
+			{
+				if (! (set[p/64] & (1UL << (p%64))))
+				{
+					continue;
+				}
+				switch (tokens[p].type)
+				{
+					case T_STAR:
+						nextset[p/64] |= 1UL << (p%64);
+						break;
+					case T_ANY:
+						nextset[(p+1)/64] |= 1UL << ((p+1)%64);
+						break;
+					case T_CHAR:
+						if (tokens[p].c == *s)
+						{
+							nextset[(p+1)/64] |= 1UL << ((p+1)%64);
+						}
+						break;
+					case T_SET:
+						if (tokens[p].set[*s/8] & (1 << (*s%8)))
+						{
+							nextset[(p+1)/64] |= 1UL << ((p+1)%64);
+						}
+						break;
+				}
+			}
+			closure (nextset);
+			next = get_dstate (nextset);
+			dstates[n].next[*s] = next;
+		}
+		n = next;
+	}
+	return (n);
+}
+
+/* Whether the name matched by match_all matched the pattern. */
+
+int
+matched (int state, int id)
+{
+	return ((dstates[state].set[patternends[id]/64] &
+		(1UL << (patternends[id]%64))) != 0);
+}
+
+/* Whether names going on from where the matcher is can still match the
+   pattern, some position of the pattern short of its end is reached. */
+
+int
+pattern_alive (int state, int id)
+{
+	int p;
+
+	for (p=(id == 0) ? 0 : patternends[id-1] + 1; p<patternends[id]; p++)
+	{
+		if (dstates[state].set[p/64] & (1UL << (p%64)))
+		{
+			return (true);
+		}
+	}
+	return (false);
+}
+
+/* File status needed to check for changes. */
+typedef struct
+{
+
+	/* Device and inode numbers. */
+	dev_t dev;
+	ino_t ino;
+
+	/* Size. */
+	off_t size;
+
+	/* Modification time. */
+	time_t mtime;
+} filestat_t;
+
+/* Token bucket, lines and bytes that can be forwarded now. */
+typedef struct
+{
+	double lines;
+	double bytes;
+
+	/* Time filled last, nanoseconds, zero if never. */
+	unsigned long last;
+} bucket_t;
+
+/* Bytes of a file fingerprinted at its start and before the offset
+   forwarded up to, to notice a file truncated and written again and
+   to find the copy a file was rotated to. */
+#define FINGERPRINT_SIZE 64
+
+/* Fingerprint of up to FINGERPRINT_SIZE bytes, none taken when the
+   length is zero. */
+typedef struct
+{
+	unsigned long hash;
+	int length;
+} fingerprint_t;
+
+/* File catalog is an array of file descriptors. */
+
+/* File descriptor. The entries are kept contiguous in one array with
+   the state checked most often first, the catalog grows as needed. */
+typedef struct
+{
+
+	/* Offset forwarded up to and current end of file offset. */
+	off_t offset;
+	off_t endpos;
+
+	/* Modified times, last and current. */
+	time_t lastmodified;
+	time_t modified;
+
+	/* Device and inode numbers identifying the file. */
+	dev_t dev;
+	ino_t ino;
+
+	/* File name. */
+	char *name;
+
+	/* Sequence number, -1 if the entry is free. */
+	int sn;
+
+	/* File descriptor. */
+	int fd;
+
+	/* Watched by change notification, otherwise polled. */
+	int watched;
+
+	/* Change notification arrived since the last check. */
+	int changed;
+
+	/* Moved or removed in its directory since the last check. */
+	int moved;
+
+	/* Lines held back by the rate limit, to be forwarded later. */
+	int throttled;
+
+	/* Queued for a reader thread, kept open until read. */
+	int queued;
+
+	/* Polling without change notification, milliseconds on the monotonic
+	   clock: when the next check is due, the interval, and when the file
+	   was last found changed. */
+	unsigned long due;
+	unsigned long interval;
+	unsigned long active;
+
+	/* Position in the heap of files to poll, -1 if not in it. */
+	int pollslot;
+
+	/* On the list of files to check, and the next one on it. */
+	int pending;
+	int nextpending;
+
+	/* Next free entry when on the free list. */
+	int nextfree;
+
+	/* Previous and next entries on the recently active list when open. */
+	int lruprev;
+	int lrunext;
+} file_t;
+
+/* State of a file used less often, kept apart by entry number so the
+   entries the change check reads stay small. */
+typedef struct
+{
+
+	/* Lines dropped since the last report. */
+	unsigned long dropped;
+
+	/* Lines and bytes forwarded and lines dropped, in all. */
+	unsigned long lines;
+	unsigned long bytes;
+	unsigned long drops;
+
+	/* Rate limit of the file. */
+	bucket_t bucket;
+
+	/* Fingerprints of the start and of the bytes before the offset. */
+	fingerprint_t head;
+	fingerprint_t tail;
+
+	/* File this one may be a copy of while that is not truncated yet,
+	   an inode number of zero if none. */
+	dev_t copydev;
+	ino_t copyino;
+
+	/* Directory in the table the file is in, -1 if none, and the
+	   previous and next files in it. */
+	int dir;
+	int previndir;
+	int nextindir;
+} fileextra_t;
+
+/* Initial number of entries in file catalog. */
+#define FILES_MIN 1024
+
+/* Number of files in the catalog. */
+int nfiles = 0;
+
+/* Number of catalog entries used so far, free or not. */
+int nslots = 0;
+
+/* Number of entries allocated for the catalog. */
+int filessize = 0;
+
+/* First free catalog entry for reuse, -1 if none. */
+int freefile = -1;
+
+/* File catalog. */
+file_t *files = NULL;
+
+/* State used less often, an entry for each in the catalog. */
+fileextra_t *extras = NULL;
+
+/* Default budget of descriptors kept open for catalogued files. */
+#define OPENFILES 256
+
+/* Budget of descriptors kept open for catalogued files. */
+int openfiles = OPENFILES;
+
+/* Number of catalogued files open. */
+int nopen = 0;
+
+/* Most and least recently active open files, -1 if none. */
+int lruhead = -1;
+int lrutail = -1;
+
+/* First and last files to check, -1 if none. */
+int pendinghead = -1;
+int pendingtail = -1;
+
+/* Files without change notification as a heap, the one due to poll
+   first on top. */
+int *polls = NULL;
+int npolls = 0;
+int pollssize = 0;
+
+/* Get the state used less often of a catalog entry. */
+
+fileextra_t *
+extra (file_t *f)
+{
+	return (&extras[f - files]);
+}
+
+/* Check file name of a catalog entry. */
+
+int
+file_same_name (int n, void *key)
+{
+	return (eqs (files[n].name, (char *) key));
+}
+
+/* Check device and inode numbers of a catalog entry. */
+
+int
+file_same_inode (int n, void *key)
+{
+	return (files[n].dev == ((filestat_t *) key)->dev &&
+		files[n].ino == ((filestat_t *) key)->ino);
+}
+
+/* File catalog index by name. */
+index_t fileindex = {NULL, NULL, 0, 0, file_same_name};
+
+/* File catalog index by device and inode numbers. */
+index_t inodeindex = {NULL, NULL, 0, 0, file_same_inode};
+
+/* Print configuration. */
+
+void
+print_configuration (void)
+{
+	if (verbose)
+	{
+		printf ("Verbose on\n");
+	}
+	if (! background)
+	{
+		printf ("Debug on\n");
+	}
+	printf ("Delay in main daemon loop %d\n", delayseconds);
+	printf ("Polled files checked every %d ms to %d s, %d s when idle\n",
+		POLL_HOT, delayseconds, delayseconds * COLD_FACTOR);
+	printf ("Data read at a time is %lu\n", (unsigned long) CHUNK_SIZE);
+	printf ("Maximum amount to forward to the log is %d\n", LINELENGTH_MAX);
+	printf ("File table size is %d of %d bytes each and %d apart\n",
+		filessize, (int) sizeof (file_t), (int) sizeof (fileextra_t));
+	printf ("Facility is %s\n", facility);
+	printf ("Facility code is %d\n", facilitycode >> 3);
+	if (target != NULL)
+	{
+		printf ("Target is %s in RFC %d format\n", target, rfcformat);
+	}
+	printf ("Log file name is %s\n", logfilename);
+	printf ("Change notification is %s\n", (notifyfd != -1) ? "on" : "off");
+	printf ("Open files budget is %d, %d open\n", openfiles, nopen);
+	printf ("Reader threads %d\n", nworkers);
+	printf ("Scanning %s\n", samefs ? "stays on one file system" :
+		"crosses file systems");
+	printf ("Rate limit per file %g lines/s %g bytes/s\n", filelines,
+		filebytes);
+	printf ("Rate limit for all files %g lines/s %g bytes/s\n",
+		globallines, globalbytes);
+	printf ("Lag before dropping %lu, lines dropped %lu\n",
+		(unsigned long) maxlag, totaldropped);
+	printf ("Allocations made %lu\n", (unsigned long) nallocations);
+	if (metricsfile != NULL)
+	{
+		printf ("Metrics file is %s\n", metricsfile);
+	}
+}
+
+/* Initialize file catalog. */
+
+void
+init_file (void)
+{
+	if (verbose)
+	{
+		printf ("Initializing file table with %d entries\n", FILES_MIN);
+	}
+	filessize = FILES_MIN;
+	files = (file_t *) allocate (filessize * sizeof (file_t));
+	extras = (fileextra_t *) allocate (filessize * sizeof (fileextra_t));
+	nslots = 0;
+	freefile = -1;
+}
+
+/* Get a free catalog entry, the catalog grows when all are in use. */
+
+int
+new_file (void)
+{
+	int n;
+
+	/* Used before but free. */
+	if (freefile != -1)
+	{
+		n = freefile;
+		freefile = files[n].nextfree;
+		return (n);
+	}
+
+	/* Grow by doubling, entry numbers stay valid. */
+	if (nslots == filessize)
+	{
+		filessize *= 2;
+		files = (file_t *) reallocate (files, filessize * sizeof (file_t));
+		extras = (fileextra_t *) reallocate (extras,
+			filessize * sizeof (fileextra_t));
+		if (verbose)
+		{
+			printf ("File table grown to %d entries\n", filessize);
+		}
+	}
+
+	/* Unallocated fresh. */
+	files[nslots].pending = false;
+	files[nslots].nextpending = -1;
+	files[nslots].pollslot = -1;
+	return (nslots++);
+}
+
+/* Print file. */
+
+void
+print_file (file_t *f)
+{
+	printf ("%40s: %d\n", "Sequence number", f->sn);
+	printf ("%40s: %s\n", "File name", f->name);
+	printf ("%40s: %d\n", "File descriptor number", f->fd);
+	printf ("%40s: %ld\n", "Device id", (long) f->dev);
+	printf ("%40s: %ld\n", "Inode number", (long) f->ino);
+	printf ("%40s: %s", "Last modification time", ctime (&f->lastmodified));
+	printf ("%40s: %s", "Current modification time", ctime (&f->modified));
+	printf ("%40s: %lld\n", "Forwarded position", (long long) f->offset);
+	printf ("%40s: %lld\n", "Current end position", (long long) f->endpos);
+	printf ("%40s: %s\n", "Watched", f->watched ? "yes" : "no");
+	printf ("%40s: %s\n", "Changed", f->changed ? "yes" : "no");
+}
+
+/* Print file catalog. */
+
+void
+print_catalog (void)
+{
+	int i;
+
+	for (i=0; i<nslots; i++)
+	{
+		if (files[i].sn != -1)
+		{
+			printf ("\n");
+			print_file (&files[i]);
+		}
+	}
+}
+
+/* Get file from the catalog. */
+
+file_t *
+get_file (char *name)
+{
+	int n;
+
+	n = index_get (&fileindex, name, hash_name (name));
+	return ((n == -1) ? NULL : &files[n]);
+}
+
+/* Put catalog entry last on the list of files to check, unless it is
+   on it already. */
+
+void
+mark_pending (int n)
+{
+	if (files[n].pending)
+	{
+		return;
+	}
+	files[n].pending = true;
+	files[n].nextpending = -1;
+	if (pendingtail != -1)
+	{
+		files[pendingtail].nextpending = n;
+	}
+	else
+	{
+		pendinghead = n;
+	}
+	pendingtail = n;
+}
+
+/* Mark file as changed, to be checked. */
+
+void
+mark_changed (file_t *f)
+{
+	f->changed = true;
+	mark_pending (f->sn);
+}
+
+/* Move the entry at the heap position given up or down to where its due
+   time belongs. */
+
+void
+sift_poll (int k)
+{
+	int n;
+	int child;
+
+	n = polls[k];
+	while (k > 0 && files[polls[(k - 1) / 2]].due > files[n].due)
+	{
+		polls[k] = polls[(k - 1) / 2];
+		files[polls[k]].pollslot = k;
+		k = (k - 1) / 2;
+	}
+	while ((child = 2 * k + 1) < npolls)
+	{
+		if (child + 1 < npolls &&
+			files[polls[child + 1]].due < files[polls[child]].due)
+		{
+			child++;
+		}
+		if (files[polls[child]].due >= files[n].due)
+		{
+			break;
+		}
+		polls[k] = polls[child];
+		files[polls[k]].pollslot = k;
+		k = child;
+	}
+	polls[k] = n;
+	files[n].pollslot = k;
+}
+
+/* Put catalog entry into the heap of files to poll. */
+
+void
+push_poll (int n)
+{
+	if (npolls == pollssize)
+	{
+		pollssize = (pollssize == 0) ? FILES_MIN : pollssize * 2;
+		polls = (int *) reallocate (polls, pollssize * sizeof (int));
+	}
+	polls[npolls] = n;
+	npolls++;
+	sift_poll (npolls - 1);
+}
+
+/* Take catalog entry out of the heap of files to poll. */
+
+void
+remove_poll (int n)
+{
+	int k;
+
+	k = files[n].pollslot;
+	if (k == -1)
+	{
+		return;
+	}
+	files[n].pollslot = -1;
+	npolls--;
+	if (k < npolls)
+	{
+		polls[k] = polls[npolls];
+		sift_poll (k);
+	}
+}
+
+/* Directory table. Directories holding catalogued files are remembered
+   with the filters selecting files in them. Only directories whose
+   contents changed are read again, reported by change notification or
+   by a new modification time when polled. */
+
+/* Filter selecting files in a directory. */
+typedef struct filter
+{
+
+	/* Pattern and exclude pattern. */
+	char *pattern;
+	char *exclude;
+
+	/* Their numbers in the matcher, -1 for no exclude pattern. */
+	int patternid;
+	int excludeid;
+
+	/* File named as an argument, NULL if the directory is scanned. */
+	char *file;
+
+	/* Next filter for the same directory. */
+	struct filter *next;
+} filter_t;
+
+/* Directory descriptor. */
+typedef struct
+{
+
+	/* Directory name, NULL if the slot is free. */
+	char *name;
+
+	/* Filters for files in the directory. */
+	filter_t *filters;
+
+	/* Modification time at the last scan. */
+	struct timespec mtime;
+
+	/* Watch descriptor, -1 if the directory is polled. */
+	int wd;
+
+	/* Contents changed since the last scan, on the list of directories
+	   to read again. */
+	int dirty;
+
+	/* Next directory on the list to read again. */
+	int nextdirty;
+
+	/* Without change notification, polled. */
+	int polled;
+
+	/* First catalogued file in the directory, -1 if none. */
+	int firstfile;
+
+	/* Next free entry when on the free list. */
+	int nextfree;
+} dir_t;
+
+/* Directory table. */
+dir_t *dirs = NULL;
+
+/* Number of slots in the directory table. */
+int ndirs = 0;
+
+/* First free directory entry for reuse, -1 if none. */
+int freedir = -1;
+
+/* First directory to read again, -1 if none. */
+int dirtydirs = -1;
+
+/* Number of directories without change notification. */
+int npolleddirs = 0;
+
+/* Check directory name of a table entry. */
+
+int
+dir_same_name (int n, void *key)
+{
+	return (eqs (dirs[n].name, (char *) key));
+}
+
+/* Directory table index by name. */
+index_t dirindex = {NULL, NULL, 0, 0, dir_same_name};
+
+/* Directory table indices by watch descriptor. */
+int *watchdirs = NULL;
+
+/* Number of slots in the watch descriptor table. */
+int nwatchdirs = 0;
+
+/* Watch descriptor not asked for yet. */
+#define WATCH_UNKNOWN ((int) -2)
+
+/* Initialize change notification. */
+
+void
+init_notify (void)
+{
+#ifdef __linux__
+	if (! notify)
+	{
+		return;
+	}
+	notifyfd = inotify_init1 (IN_NONBLOCK|IN_CLOEXEC);
+	if (notifyfd == -1)
+	{
+		perror ("Change notification not available, polling");
+	}
+#endif
+}
+
+/* Check if the file system holding the directory delivers change
+   notification for all changes. Network and cluster file systems
+   only report local modifications, files there have to be polled. */
+
+int
+notifiable (char *path)
+{
+	int status;
+	struct statfs sfs;
+
+	status = statfs (path, &sfs);
+	if (status == -1)
+	{
+		return (false);
+	}
+	switch ((unsigned long) sfs.f_type)
+	{
+	case 0x6969UL:		/* NFS. */
+	case 0xff534d42UL:	/* CIFS. */
+	case 0xfe534d42UL:	/* SMB2. */
+	case 0x517bUL:		/* SMB. */
+	case 0x65735546UL:	/* FUSE. */
+	case 0x47504653UL:	/* GPFS. */
+	case 0x0bd00bd0UL:	/* Lustre. */
+	case 0x01161970UL:	/* GFS2. */
+	case 0x7461636fUL:	/* OCFS2. */
+	case 0x00c36400UL:	/* CephFS. */
+		return (false);
+	default:
+		return (true);
+	}
+}
+
+/* Watch directory by name, return the watch descriptor or -1 to poll.
+   Also called by the scanning threads. */
+
+int
+watch_path (char *name)
+{
+#ifdef __linux__
+	int wd;
+
+	if (notifyfd == -1)
+	{
+		return (-1);
+	}
+	if (! notifiable (name))
+	{
+		if (verbose)
+		{
+			printf ("Polling %s\n", name);
+		}
+		return (-1);
+	}
+	wd = inotify_add_watch (notifyfd, name,
+		IN_MODIFY|IN_CLOSE_WRITE|IN_MOVED_FROM|IN_MOVED_TO|IN_DELETE|
+		IN_CREATE|IN_MOVE_SELF|IN_ONLYDIR);
+	if (wd == -1)
+	{
+		fprintf (stderr, "Cannot watch %s, polling\n", name);
+		perror ("Error context");
+		return (-1);
+	}
+	return (wd);
+#else
+	return (-1);
+#endif
+}
+
+/* Remember the directory for its watch descriptor, return the watch
+   descriptor. */
+
+int
+keep_watch (int n, int wd)
+{
+#ifdef __linux__
+	int size;
+
+	if (wd == -1)
+	{
+		return (-1);
+	}
+	if (wd >= nwatchdirs)
+	{
+		size = (nwatchdirs == 0) ? 64 : nwatchdirs;
+		while (size <= wd)
+		{
+			size *= 2;
+		}
+		watchdirs = (int *) reallocate (watchdirs, size * sizeof (int));
+		while (nwatchdirs < size)
+		{
+			watchdirs[nwatchdirs++] = -1;
+		}
+	}
+	watchdirs[wd] = n;
+#endif
+	return (wd);
+}
+
+/* Get directory from the table, -1 if not there. */
+
+int
+get_dir (char *name)
+{
+	return (index_get (&dirindex, name, hash_name (name)));
+}
+
+/* Check if the directory has the filter already. */
+
+int
+has_filter (int n, char *pattern, char *exclude, char *file)
+{
+	filter_t *filter;
+
+	for (filter=dirs[n].filters; filter!=NULL; filter=filter->next)
+	{
+		if (filter->pattern == pattern && filter->exclude == exclude &&
+			((filter->file == NULL && file == NULL) ||
+			(filter->file != NULL && file != NULL &&
+			eqs (filter->file, file))))
+		{
+			return (true);
+		}
+	}
+	return (false);
+}
+
+/* Put new directory into the table, return its index. The watch
+   descriptor and the modification time are taken when the scan got
+   them already, the watch is WATCH_UNKNOWN and the time NULL if not. */
+
+int
+new_dir (char *name, int wd, struct timespec *mtime)
+{
+	int n;
+	int i;
+	dir_t *d;
+	struct stat st;
+
+	/* Grow the table when there are no free slots. */
+	if (freedir == -1)
+	{
+		n = ndirs;
+		ndirs = (ndirs == 0) ? 64 : ndirs * 2;
+		dirs = (dir_t *) reallocate (dirs, ndirs * sizeof (dir_t));
+		for (i=ndirs-1; i>=n; i--)
+		{
+			dirs[i].name = NULL;
+			dirs[i].dirty = false;
+			dirs[i].nextfree = freedir;
+			freedir = i;
+		}
+	}
+
+	/* Fill first free slot. */
+	n = freedir;
+	d = &dirs[n];
+	freedir = d->nextfree;
+	d->nextfree = -1;
+	d->name = strdup (name);
+	index_put (&dirindex, hash_name (d->name), n);
+	d->filters = NULL;
+	d->firstfile = -1;
+	(void) memset (&d->mtime, 0, sizeof (d->mtime));
+	if (mtime != NULL)
+	{
+		d->mtime = *mtime;
+	}
+	else if (stat (name, &st) == 0)
+	{
+		d->mtime = st.st_mtim;
+	}
+	d->wd = -1;
+	if (wd == WATCH_UNKNOWN)
+	{
+		wd = watch_path (name);
+	}
+	d->wd = keep_watch (n, wd);
+	d->polled = (d->wd == -1);
+	npolleddirs += d->polled;
+	return (n);
+}
+
+/* Add a filter to the directory unless it has it already. */
+
+void
+add_filter (int n, char *pattern, char *exclude, char *file)
+{
+	filter_t *filter;
+
+	if (! has_filter (n, pattern, exclude, file))
+	{
+		filter = new (filter_t);
+		filter->pattern = pattern;
+		filter->exclude = exclude;
+		filter->patternid = pattern_id (pattern);
+		filter->excludeid = (exclude == NULL || *exclude == EOS) ? -1 :
+			pattern_id (exclude);
+		filter->file = (file == NULL) ? NULL : strdup (file);
+		filter->next = dirs[n].filters;
+		dirs[n].filters = filter;
+	}
+}
+
+/* Put directory with a filter into the table, return its index. */
+
+int
+put_dir (char *name, char *pattern, char *exclude, char *file)
+{
+	int n;
+
+	n = get_dir (name);
+	if (n == -1)
+	{
+		n = new_dir (name, WATCH_UNKNOWN, NULL);
+	}
+	add_filter (n, pattern, exclude, file);
+	return (n);
+}
+
+/* Put directory on the list to read again, unless it is on it. */
+
+void
+mark_dirty (int n)
+{
+	if (dirs[n].name == NULL || dirs[n].dirty)
+	{
+		return;
+	}
+	dirs[n].dirty = true;
+	dirs[n].nextdirty = dirtydirs;
+	dirtydirs = n;
+}
+
+/* Mark all catalogued files as changed. */
+
+void
+mark_all_changed (void)
+{
+	int i;
+
+	for (i=0; i<nslots; i++)
+	{
+		if (files[i].sn != -1)
+		{
+			mark_changed (&files[i]);
+		}
+	}
+}
+
+/* Get the directory in the table a file name is in, -1 if none. */
+
+int
+dir_of (char *name)
+{
+	char dircopy[PATH_MAX+1];
+
+	dircopy[PATH_MAX] = EOS;
+	(void) strncpy (dircopy, name, PATH_MAX);
+	return (get_dir (dirname (dircopy)));
+}
+
+/* Put catalog entry on the list of files of the directory, if any. */
+
+void
+link_file (int i, int n)
+{
+	fileextra_t *x;
+
+	x = &extras[i];
+	x->dir = n;
+	x->previndir = -1;
+	x->nextindir = -1;
+	if (n != -1)
+	{
+		x->nextindir = dirs[n].firstfile;
+		if (x->nextindir != -1)
+		{
+			extras[x->nextindir].previndir = i;
+		}
+		dirs[n].firstfile = i;
+	}
+}
+
+/* Take catalog entry off the list of files of its directory. */
+
+void
+unlink_file (int i)
+{
+	fileextra_t *x;
+
+	x = &extras[i];
+	if (x->dir == -1)
+	{
+		return;
+	}
+	if (x->previndir != -1)
+	{
+		extras[x->previndir].nextindir = x->nextindir;
+	}
+	else
+	{
+		dirs[x->dir].firstfile = x->nextindir;
+	}
+	if (x->nextindir != -1)
+	{
+		extras[x->nextindir].previndir = x->previndir;
+	}
+	x->dir = -1;
+}
+
+/* Remove directory from the table. The files in it are checked. */
+
+void
+remove_dir (int n)
+{
+	dir_t *d;
+	filter_t *filter;
+	int i;
+
+	d = &dirs[n];
+	if (verbose)
+	{
+		printf ("Deregister directory %s\n", d->name);
+	}
+#ifdef __linux__
+	if (d->wd != -1)
+	{
+		(void) inotify_rm_watch (notifyfd, d->wd);
+		watchdirs[d->wd] = -1;
+	}
+#endif
+	while (d->filters != NULL)
+	{
+		filter = d->filters;
+		d->filters = filter->next;
+		if (filter->file != NULL)
+		{
+			free (filter->file);
+		}
+		free (filter);
+	}
+	index_remove (&dirindex, hash_name (d->name), n);
+	free (d->name);
+	d->name = NULL;
+	npolleddirs -= d->polled;
+	d->polled = false;
+	d->nextfree = freedir;
+	freedir = n;
+	while (d->firstfile != -1)
+	{
+		i = d->firstfile;
+		unlink_file (i);
+		mark_changed (&files[i]);
+	}
+}
+
+/* Unlink open file from the recently active list. */
+
+void
+lru_unlink (int n)
+{
+	file_t *f;
+
+	f = &files[n];
+	if (f->lruprev != -1)
+	{
+		files[f->lruprev].lrunext = f->lrunext;
+	}
+	else
+	{
+		lruhead = f->lrunext;
+	}
+	if (f->lrunext != -1)
+	{
+		files[f->lrunext].lruprev = f->lruprev;
+	}
+	else
+	{
+		lrutail = f->lruprev;
+	}
+	f->lruprev = -1;
+	f->lrunext = -1;
+}
+
+/* Put open file first on the recently active list. */
+
+void
+lru_push (int n)
+{
+	file_t *f;
+
+	f = &files[n];
+	f->lruprev = -1;
+	f->lrunext = lruhead;
+	if (lruhead != -1)
+	{
+		files[lruhead].lruprev = n;
+	}
+	lruhead = n;
+	if (lrutail == -1)
+	{
+		lrutail = n;
+	}
+}
+
+/* Close the descriptor of a catalogued file. */
+
+void
+close_file (file_t *f)
+{
+	int status;
+
+	if (f->fd == -1)
+	{
+		return;
+	}
+	lru_unlink (f->sn);
+	status = close (f->fd);
+	if (status == -1)
+	{
+		fprintf (stderr, "Error closing %s\n", f->name);
+		perror ("Error context");
+		error ("Cannot close");
+	}
+	f->fd = -1;
+	nopen--;
+}
+
+/* Keep the descriptor for a catalogued file not open, opened some other
+   way than by its name. */
+
+void
+keep_fd (file_t *f, int fd)
+{
+	int victim;
+	int prev;
+
+	/* Make room. The files queued for the reader threads stay open. */
+	victim = lrutail;
+	while (nopen >= openfiles && victim != -1)
+	{
+		prev = files[victim].lruprev;
+		if (! files[victim].queued)
+		{
+			close_file (&files[victim]);
+		}
+		victim = prev;
+	}
+	f->fd = fd;
+	nopen++;
+	lru_push (f->sn);
+}
+
+/* Open a catalogued file by name unless it is open already. The least
+   recently active files are closed to stay within the budget. Return
+   the descriptor, -1 with errno set on failure. */
+
+int
+open_file (file_t *f)
+{
+	int fd;
+
+	/* Open already, it is the most recently active now. */
+	if (f->fd != -1)
+	{
+		if (lruhead != f->sn)
+		{
+			lru_unlink (f->sn);
+			lru_push (f->sn);
+		}
+		return (f->fd);
+	}
+
+	/* Open file, room is made for it once open. */
+	fd = open (f->name, O_RDONLY|O_CLOEXEC);
+	if (fd == -1)
+	{
+		return (-1);
+	}
+	keep_fd (f, fd);
+	return (fd);
+}
+
+/* Set device and inode numbers of a catalogued file. */
+
+void
+set_inode (file_t *f, dev_t dev, ino_t ino)
+{
+	if (f->dev == dev && f->ino == ino)
+	{
+		return;
+	}
+	index_remove (&inodeindex, hash_inode (f->dev, f->ino), f->sn);
+	f->dev = dev;
+	f->ino = ino;
+	index_put (&inodeindex, hash_inode (dev, ino), f->sn);
+}
+
+/* Rename a catalogued file. */
+
+void
+rename_file (file_t *f, char *name)
+{
+	if (verbose)
+	{
+		printf ("Renamed %s to %s\n", f->name, name);
+	}
+	index_remove (&fileindex, hash_name (f->name), f->sn);
+	free (f->name);
+	f->name = strdup (name);
+	index_put (&fileindex, hash_name (f->name), f->sn);
+	unlink_file (f->sn);
+	link_file (f->sn, dir_of (f->name));
+}
+
+/* Get file status by name, relative to the directory descriptor, with a
+   single call asking only for what the change check needs. Return 0,
+   -1 with errno set on failure. */
+
+int
+stat_file_at (int dirfd, char *name, filestat_t *fs)
+{
+#ifdef STATX_SIZE
+	struct statx stx;
+
+	if (statx (dirfd, name, AT_STATX_SYNC_AS_STAT,
+		STATX_SIZE|STATX_MTIME|STATX_INO, &stx) == -1)
+	{
+		return (-1);
+	}
+	fs->dev = makedev (stx.stx_dev_major, stx.stx_dev_minor);
+	fs->ino = (ino_t) stx.stx_ino;
+	fs->size = (off_t) stx.stx_size;
+	fs->mtime = (time_t) stx.stx_mtime.tv_sec;
+#else
+	struct stat st;
+
+	if (fstatat (dirfd, name, &st, 0) == -1)
+	{
+		return (-1);
+	}
+	fs->dev = st.st_dev;
+	fs->ino = st.st_ino;
+	fs->size = st.st_size;
+	fs->mtime = st.st_mtime;
+#endif
+	return (0);
+}
+
+/* Get file status by name. */
+
+int
+stat_file (char *name, filestat_t *fs)
+{
+	return (stat_file_at (AT_FDCWD, name, fs));
+}
+
+/* Get file status by descriptor. */
+
+int
+fstat_file (int fd, filestat_t *fs)
+{
+	struct stat st;
+
+	if (fstat (fd, &st) == -1)
+	{
+		return (-1);
+	}
+	fs->dev = st.st_dev;
+	fs->ino = st.st_ino;
+	fs->size = st.st_size;
+	fs->mtime = st.st_mtime;
+	return (0);
+}
+
+/* Open a file renamed away by its new name unless it is open, so that
+   what was not forwarded yet is read to the end once the rename is
+   noticed. */
+
+void
+hold_renamed (file_t *f, char *name)
+{
+	filestat_t fs;
+	int fd;
+
+	if (f->sn == -1 || f->fd != -1)
+	{
+		return;
+	}
+	fd = open (name, O_RDONLY|O_CLOEXEC);
+	if (fd == -1)
+	{
+		return;
+	}
+	if (fstat_file (fd, &fs) == -1 || fs.dev != f->dev || fs.ino != f->ino)
+	{
+		(void) close (fd);
+		return;
+	}
+	keep_fd (f, fd);
+}
+
+/* Read pending change notifications, mark the files changed and
+   the directories with new entries dirty. */
+
+void
+read_notify (void)
+{
+#ifdef __linux__
+	char buf[8192] __attribute__ ((aligned (__alignof__ (struct inotify_event))));
+	char name[PATH_MAX+1];
+	struct inotify_event *ev;
+	ssize_t len;
+	char *p;
+	uint32_t cookie;
+	int renamed;
+	int n;
+	int i;
+	file_t *f;
+
+	renamed = -1;
+	cookie = 0;
+	while (true)
+	{
+		len = read (notifyfd, buf, sizeof (buf));
+		if (len == (ssize_t) -1)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			if (errno != EAGAIN)
+			{
+				perror ("Error reading change notification");
+			}
+			return;
+		}
+		for (p=buf; p<buf+len; p+=sizeof (struct inotify_event)+ev->len)
+		{
+			ev = (struct inotify_event *) p;
+
+			/* Events were lost, everything has to be checked. */
+			if (ev->mask & IN_Q_OVERFLOW)
+			{
+				mark_all_changed ();
+				for (i=0; i<ndirs; i++)
+				{
+					mark_dirty (i);
+				}
+				continue;
+			}
+
+			/* Find the directory of the watch. */
+			if (ev->wd < 0 || ev->wd >= nwatchdirs)
+			{
+				continue;
+			}
+			n = watchdirs[ev->wd];
+			if (n == -1)
+			{
+				continue;
+			}
+
+			/* Watch is gone with its directory. */
+			if (ev->mask & IN_IGNORED)
+			{
+				dirs[n].wd = -1;
+				watchdirs[ev->wd] = -1;
+				remove_dir (n);
+				continue;
+			}
+
+			/* Directory moved away, its name is no longer valid. */
+			if (ev->mask & IN_MOVE_SELF)
+			{
+				remove_dir (n);
+				continue;
+			}
+
+			/* New entries in the directory. */
+			if (ev->mask & (IN_CREATE|IN_MOVED_TO))
+			{
+				mark_dirty (n);
+			}
+
+			/* Mark the file the event is about. */
+			if (ev->len == 0)
+			{
+				continue;
+			}
+			(void) snprintf (name, sizeof (name), "%s/%s",
+				dirs[n].name, ev->name);
+			f = get_file (name);
+
+			/* The second half of a rename, the file moved away is held
+			   open by its new name to forward the rest of it. */
+			if ((ev->mask & IN_MOVED_TO) && renamed != -1 &&
+				ev->cookie == cookie)
+			{
+				hold_renamed (&files[renamed], name);
+				renamed = -1;
+			}
+			if (f != NULL)
+			{
+				mark_changed (f);
+
+				/* The name may refer to another file now, either way
+				   the next check has to go by name. */
+				if (ev->mask & (IN_MOVED_FROM|IN_DELETE|IN_MOVED_TO|IN_CREATE))
+				{
+					f->moved = true;
+				}
+				if (ev->mask & IN_MOVED_FROM)
+				{
+					renamed = f->sn;
+					cookie = ev->cookie;
+				}
+			}
+		}
+	}
+#endif
+}
+
+/* Event loop. Change notification, signals, the timer for what is due
+   next and the connection to the target are waited for together. */
+#define EVENTS_MAX 16
+int epollfd = -1;
+int timerfd = -1;
+int signalsfd = -1;
+
+/* Wait for events on the descriptor, or change the events waited for. */
+
+void
+watch_fd (int fd, uint32_t events)
+{
+	struct epoll_event ev;
+
+	if (epollfd == -1)
+	{
+		return;
+	}
+	ev.events = events;
+	ev.data.fd = fd;
+	if (epoll_ctl (epollfd, EPOLL_CTL_ADD, fd, &ev) == -1 &&
+		(errno != EEXIST || epoll_ctl (epollfd, EPOLL_CTL_MOD, fd, &ev) == -1))
+	{
+		perror ("Error context");
+		error ("Cannot wait for events");
+	}
+}
+
+/* Checkpoints. The offsets forwarded up to are saved by device and
+   inode numbers in the state file in the log directory, so that after
+   a restart the files are forwarded from where they were left. */
+#define STATE_NAME "logforw.state"
+
+/* Time between checkpoints, seconds. */
+#define CHECKPOINT_INTERVAL 10
+
+/* State file header, the records follow. */
+#define STATE_MAGIC "LFSTATE1"
+typedef struct
+{
+	char magic[8];
+
+	/* Number of records and time written. */
+	uint64_t count;
+	int64_t written;
+} statehead_t;
+
+/* State file record. */
+typedef struct
+{
+	uint64_t dev;
+	uint64_t ino;
+	int64_t offset;
+} staterecord_t;
+
+/* Records read at startup, and the time they were written, zero if
+   there were none. */
+staterecord_t *saved = NULL;
+time_t savedtime = (time_t) 0;
+
+/* Checkpoint being written, the buffer only grows. */
+char *statebuffer = NULL;
+size_t statebuffersize = 0;
+
+/* Set once the files given have been scanned, files found from then on
+   have been created since. */
+int started = false;
+
+/* Offsets changed since the last checkpoint. */
+int progress = false;
+
+/* Files forwarded up to an offset while known by another name, as a
+   file rotated away or the copy of a truncated file, the latest ones.
+   Found under a name of their own within a few delays they go on from
+   there instead of from the start. */
+#define DRAINED_MAX 16
+typedef struct
+{
+	dev_t dev;
+	ino_t ino;
+	off_t offset;
+	time_t until;
+} drained_t;
+drained_t drained[DRAINED_MAX];
+int nextdrained = 0;
+
+/* Take note of a file forwarded up to the offset given. */
+
+void
+note_drained (dev_t dev, ino_t ino, off_t offset)
+{
+	if (offset == 0)
+	{
+		return;
+	}
+	drained[nextdrained].dev = dev;
+	drained[nextdrained].ino = ino;
+	drained[nextdrained].offset = offset;
+	drained[nextdrained].until = time (NULL) + 2 * delayseconds;
+	nextdrained = (nextdrained + 1) % DRAINED_MAX;
+}
+
+/* Compare saved record with device and inode numbers. */
+
+int
+saved_same (int n, void *key)
+{
+	return (saved[n].dev == (uint64_t) ((filestat_t *) key)->dev &&
+		saved[n].ino == (uint64_t) ((filestat_t *) key)->ino);
+}
+
+/* Saved records by device and inode numbers. */
+index_t savedindex = {NULL, NULL, 0, 0, saved_same};
+
+/* Get name of a file in the log directory. */
+
+void
+state_path (char *path, char *name)
+{
+	char logcopy[PATH_MAX+1];
+
+	logcopy[PATH_MAX] = EOS;
+	(void) strncpy (logcopy, logfilename, PATH_MAX);
+	(void) snprintf (path, PATH_MAX + 1, "%s/%s", dirname (logcopy), name);
+}
+
+/* Read the state file, with one read for all the records. */
+
+void
+read_checkpoint (void)
+{
+	char path[PATH_MAX+1];
+	statehead_t head;
+	size_t size;
+	uint64_t i;
+	int fd;
+
+	state_path (path, STATE_NAME);
+	fd = open (path, O_RDONLY|O_CLOEXEC);
+	if (fd == -1)
+	{
+		return;
+	}
+	if (read (fd, &head, sizeof (head)) != (ssize_t) sizeof (head) ||
+		memcmp (head.magic, STATE_MAGIC, sizeof (head.magic)) != 0 ||
+		head.count > (uint64_t) INT_MAX)
+	{
+		(void) fprintf (stderr, "State file %s is not valid\n", path);
+		(void) close (fd);
+		return;
+	}
+	size = (size_t) head.count * sizeof (staterecord_t);
+	saved = (staterecord_t *) allocate (size + 1);
+	if (read (fd, saved, size) != (ssize_t) size)
+	{
+		(void) fprintf (stderr, "State file %s is short\n", path);
+		(void) close (fd);
+		free (saved);
+		saved = NULL;
+		return;
+	}
+	(void) close (fd);
+	for (i=0; i<head.count; i++)
+	{
+		index_put (&savedindex, hash_inode ((dev_t) saved[i].dev,
+			(ino_t) saved[i].ino), (int) i);
+	}
+	savedtime = (time_t) head.written;
+	if (verbose)
+	{
+		printf ("Resuming %lu files from %s", (unsigned long) head.count,
+			ctime (&savedtime));
+	}
+}
+
+/* Offset to start a file from. A file saved resumes from its offset,
+   from the start if it has shrunk since. A file not saved but changed
+   since the checkpoint was written is new and starts at the start, any
+   other at the end. A file found after startup starts at the start,
+   unless it was forwarded already under another name. */
+
+off_t
+resume_offset (filestat_t *fs)
+{
+	off_t offset;
+	int n;
+
+	if (started)
+	{
+		for (n=0; n<DRAINED_MAX; n++)
+		{
+			if (drained[n].offset > 0 && drained[n].dev == fs->dev &&
+				drained[n].ino == fs->ino &&
+				drained[n].until >= time (NULL))
+			{
+				offset = drained[n].offset;
+				drained[n].offset = (off_t) 0;
+				return ((offset <= fs->size) ? offset : (off_t) 0);
+			}
+		}
+		return ((off_t) 0);
+	}
+	if (savedtime == (time_t) 0)
+	{
+		return (fs->size);
+	}
+	n = index_get (&savedindex, fs, hash_inode (fs->dev, fs->ino));
+	if (n != -1)
+	{
+		return ((saved[n].offset <= (int64_t) fs->size) ?
+			(off_t) saved[n].offset : (off_t) 0);
+	}
+	return ((fs->mtime > savedtime) ? (off_t) 0 : fs->size);
+}
+
+/* Drop the records read at startup. */
+
+void
+forget_checkpoint (void)
+{
+	if (saved != NULL)
+	{
+		free (saved);
+		saved = NULL;
+		index_free (&savedindex);
+	}
+	savedtime = (time_t) 0;
+}
+
+/* Write the state file. The records are written to a temporary file in
+   one go, synced once and renamed over the state file. */
+
+void
+write_checkpoint (void)
+{
+	char path[PATH_MAX+1];
+	char temp[PATH_MAX+1];
+	statehead_t *head;
+	staterecord_t *records;
+	size_t size;
+	int count;
+	int status;
+	int fd;
+	int i;
+
+	/* Collect the records behind the header. */
+	size = sizeof (statehead_t) + (size_t) nfiles * sizeof (staterecord_t);
+	head = (statehead_t *) reserve (&statebuffer, &statebuffersize, size);
+	records = (staterecord_t *) (head + 1);
+	count = 0;
+	for (i=0; i<nslots && count<nfiles; i++)
+	{
+		if (files[i].sn != -1)
+		{
+			records[count].dev = (uint64_t) files[i].dev;
+			records[count].ino = (uint64_t) files[i].ino;
+			records[count].offset = (int64_t) files[i].offset;
+			count++;
+		}
+	}
+	(void) memcpy (head->magic, STATE_MAGIC, sizeof (head->magic));
+	head->count = (uint64_t) count;
+	head->written = (int64_t) time (NULL);
+	size = sizeof (statehead_t) + (size_t) count * sizeof (staterecord_t);
+
+	/* Replace the state file. */
+	state_path (path, STATE_NAME);
+	state_path (temp, STATE_NAME ".tmp");
+	fd = open (temp, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, (mode_t) 0600);
+	status = (fd == -1) ? -1 : 0;
+	if (status == 0 && write (fd, head, size) != (ssize_t) size)
+	{
+		status = -1;
+	}
+	if (status == 0 && fsync (fd) == -1)
+	{
+		status = -1;
+	}
+	if (fd != -1 && close (fd) == -1)
+	{
+		status = -1;
+	}
+	if (status == 0 && rename (temp, path) == -1)
+	{
+		status = -1;
+	}
+	if (status == -1)
+	{
+		(void) fprintf (stderr, "Cannot write state file %s: %s\n", path,
+			strerror (errno));
+		(void) unlink (temp);
+	}
+	progress = false;
+}
+
+/* Find the file a name was made from by appending a suffix starting
+   with a dot or a dash, as rotation names a copy. Return its entry if
+   something of it was forwarded already, otherwise -1. */
+
+int
+find_original (char *name)
+{
+	char base[PATH_MAX+1];
+	char *slash;
+	char *dot;
+	char *dash;
+	char *end;
+	file_t *f;
+
+	base[PATH_MAX] = EOS;
+	(void) strncpy (base, name, PATH_MAX);
+	slash = strrchr (base, '/');
+	if (slash == NULL)
+	{
+		return (-1);
+	}
+	while (true)
+	{
+		dot = strrchr (slash, '.');
+		dash = strrchr (slash, '-');
+		if (dot == NULL && dash == NULL)
+		{
+			break;
+		}
+		end = (dash == NULL || (dot != NULL && dot > dash)) ? dot : dash;
+		*end = EOS;
+		f = get_file (base);
+		if (f != NULL && f->offset > 0)
+		{
+			return (f->sn);
+		}
+	}
+	return (-1);
+}
+
+/* Add file not in the catalog yet with its status. The file is not
+   opened until it is read. */
+
+void
+add_file (char *name, filestat_t *fs)
+{
+	filestat_t other;
+	char *oldname;
+	file_t *f;
+	fileextra_t *x;
+	int i;
+	int n;
+
+	/* A file renamed within the watched directories keeps its entry,
+	   and its descriptor if open. A file created under the name it had
+	   may have been passed over while the name was taken. */
+	n = index_get (&inodeindex, fs, hash_inode (fs->dev, fs->ino));
+	if (n != -1)
+	{
+		oldname = strdup (files[n].name);
+		rename_file (&files[n], name);
+		if (get_file (oldname) == NULL && stat_file (oldname, &other) == 0)
+		{
+			add_file (oldname, &other);
+		}
+		free (oldname);
+		return;
+	}
+
+	/* Print message. */
+	if (verbose)
+	{
+		printf ("Registering %s\n", name);
+	}
+
+	/* Take a free slot or a fresh one. */
+	i = new_file ();
+	f = &files[i];
+	x = extra (f);
+
+	/* Fill new slot. */
+	f->sn = i;
+	f->name = strdup (name);
+	f->nextfree = -1;
+	f->fd = -1;
+	f->lruprev = -1;
+	f->lrunext = -1;
+	f->moved = false;
+	index_put (&fileindex, hash_name (f->name), i);
+
+	/* Remember the file identity. */
+	f->dev = fs->dev;
+	f->ino = fs->ino;
+	index_put (&inodeindex, hash_inode (f->dev, f->ino), i);
+
+	/* Get last and current modification dates. */
+	f->lastmodified = fs->mtime;
+	f->modified = f->lastmodified;
+
+	/* Get last and current end of file offset. A file resumed from
+	   the checkpoint is forwarded from there on the next check. */
+	f->offset = resume_offset (fs);
+	f->endpos = f->offset;
+
+	/* Changes are notified if the directory is watched, otherwise
+	   the file will be polled. */
+	n = dir_of (name);
+	link_file (i, n);
+	f->watched = (n != -1) && (dirs[n].wd != -1);
+	f->changed = false;
+	if (f->offset != fs->size)
+	{
+		mark_changed (f);
+	}
+	f->throttled = false;
+	f->queued = false;
+	x->dropped = 0;
+	x->lines = 0;
+	x->bytes = 0;
+	x->drops = 0;
+	x->bucket.last = 0;
+	x->head.length = 0;
+	x->tail.length = 0;
+
+	/* A new file named after one forwarded already may be a copy made
+	   for copytruncate rotation, it is held back until known. */
+	x->copyino = (ino_t) 0;
+	if (started && f->offset == 0)
+	{
+		n = find_original (name);
+		if (n != -1)
+		{
+			x->copydev = files[n].dev;
+			x->copyino = files[n].ino;
+		}
+	}
+
+	/* Polled soon, files not changed for long back off to the slow
+	   tier right away. */
+	f->interval = POLL_HOT;
+	f->due = now_ms () + POLL_HOT;
+	f->active = (time (NULL) - fs->mtime <
+		(time_t) delayseconds * COLD_FACTOR) ? now_ms () : 0UL;
+	if (! f->watched)
+	{
+		push_poll (i);
+	}
+	nfiles++;
+}
+
+/* Put file into the catalog. */
+
+void
+put_file (char *name)
+{
+	filestat_t fs;
+	file_t *f;
+
+	/* Check if we got the file already. One left without its directory
+	   when that was dropped goes back in it. */
+	f = get_file (name);
+	if (f != NULL)
+	{
+		if (extra (f)->dir == -1)
+		{
+			link_file (f->sn, dir_of (name));
+		}
+		return;
+	}
+
+	/* Get status, the file may be gone already. */
+	if (stat_file (name, &fs) == -1)
+	{
+		return;
+	}
+	add_file (name, &fs);
+}
+
+/* Remove file entry from the catalog. */
+
+void
+remove_entry (int n)
+{
+	file_t *f;
+
+	/* File is by the number. */
+	f = &files[n];
+
+	if (f->sn != -1)
+	{
+
+		/* Close and drop it from the indices and the heap of files to
+		   poll. It is left on the list of files to check, where it is
+		   passed over. */
+		close_file (f);
+		remove_poll (n);
+		unlink_file (n);
+		index_remove (&fileindex, hash_name (f->name), n);
+		index_remove (&inodeindex, hash_inode (f->dev, f->ino), n);
+
+		/* Mark it as removed and put it on the free list. */
+		f->sn = -1;
+		f->nextfree = freefile;
+		freefile = n;
+
+		/* Free allocated objects. */
+		free (f->name);
+		f->name = NULL;
+
+		/* Its counts go to the totals. */
+		pastlines += extra (f)->lines;
+		pastbytes += extra (f)->bytes;
+		pastdrops += extra (f)->drops;
+
+		/* Initialize. */
+		f->lastmodified = (time_t) 0;
+		f->modified = (time_t) 0;
+		f->offset = (off_t) 0;
+		f->endpos = (off_t) 0;
+		f->dev = (dev_t) 0;
+		f->ino = (ino_t) 0;
+		f->watched = false;
+		f->changed = false;
+		f->moved = false;
+		nfiles--;
+	}
+}
+
+/* Direct syslog transport. Messages are formatted here and sent in
+   batches with sendmmsg to a Unix datagram socket or to a UDP target,
+   or written with octet counting framing to a TCP connection. */
+
+/* Number of messages sent at a time. */
+#define BATCH_MAX 64
+
+/* Room for the message header before the line. */
+#define HEADER_MAX 512
+
+/* Space for the messages of a batch, or the stream buffer. */
+#define BATCH_SIZE ((size_t) BATCH_MAX * (LINELENGTH_MAX + HEADER_MAX))
+
+/* Time to wait for a connection to be established, seconds. */
+#define CONNECT_TIMEOUT 5
+
+/* Longest delay between attempts to reconnect, seconds. */
+#define BACKOFF_MAX 60
+
+/* Longest time to wait for a busy target without a spool on a pass,
+   for the lines already read, milliseconds. */
+#define SINK_WAIT 1000
+
+/* Facility codes by name. */
+struct
+{
+	char *name;
+	int code;
+} facilitycodes[] =
+{
+	{"kern", LOG_KERN}, {"user", LOG_USER}, {"mail", LOG_MAIL},
+	{"daemon", LOG_DAEMON}, {"auth", LOG_AUTH}, {"syslog", LOG_SYSLOG},
+	{"lpr", LOG_LPR}, {"news", LOG_NEWS}, {"uucp", LOG_UUCP},
+	{"cron", LOG_CRON}, {"authpriv", LOG_AUTHPRIV}, {"ftp", LOG_FTP},
+	{"local0", LOG_LOCAL0}, {"local1", LOG_LOCAL1}, {"local2", LOG_LOCAL2},
+	{"local3", LOG_LOCAL3}, {"local4", LOG_LOCAL4}, {"local5", LOG_LOCAL5},
+	{"local6", LOG_LOCAL6}, {"local7", LOG_LOCAL7}, {NULL, 0}
+};
+
+/* Sink state. */
+typedef struct
+{
+
+	/* Socket, -1 if not connected. */
+	int fd;
+
+	/* Messages of the batch, or the stream data, one buffer for all. */
+	char *buffer;
+	size_t used;
+
+	/* Datagrams of the batch. */
+	struct mmsghdr msgs[BATCH_MAX];
+	struct iovec iov[BATCH_MAX];
+	int count;
+
+	/* Stream data written so far. */
+	size_t done;
+
+	/* Target takes no more for now, sent again when the socket is
+	   writable. */
+	int blocked;
+
+	/* Time of the next attempt to connect and the delay after it. */
+	time_t retry;
+	int backoff;
+
+	/* Connection being made, given up at the time set. */
+	int connecting;
+	time_t connectby;
+
+	/* Message header, rebuilt when the second changes. */
+	char header[HEADER_MAX];
+	size_t headerlength;
+	time_t headertime;
+
+	/* Host name to put in the header, empty for the local socket. */
+	char hostname[HOST_NAME_MAX+1];
+
+	/* Datagram target, connected again when the receiver comes back. */
+	struct sockaddr_storage addr;
+	socklen_t addrlen;
+
+	/* Messages sent and dropped. */
+	unsigned long sent;
+	unsigned long dropped;
+
+	/* Messages dropped since the last report. */
+	unsigned long unreported;
+} sink_t;
+
+/* The output sink. */
+sink_t sink;
+
+/* Target busy and no spool to take the messages, the lines are held
+   back in the files until it takes them. Read by the reader threads. */
+atomic_int sinkbusy;
+
+/* Time left to wait for a busy target on this pass, milliseconds. */
+long sinkwait = SINK_WAIT;
+
+/* Get facility code by name. */
+
+int
+get_facility (char *name)
+{
+	int i;
+
+	for (i=0; facilitycodes[i].name!=NULL; i++)
+	{
+		if (eqs (facilitycodes[i].name, name))
+		{
+			return (facilitycodes[i].code);
+		}
+	}
+	(void) fprintf (stderr, "Facility code is '%s'\n", name);
+	error ("Unknown facility code");
+	return (0);
+}
+
+/* Resolve host:port, the port defaults to 514. Return NULL on failure. */
+
+struct addrinfo *
+resolve (char *hostport, int socktype)
+{
+	struct addrinfo hints;
+	struct addrinfo *ai;
+	char host[PATH_MAX+1];
+	char *port;
+	int status;
+
+	host[PATH_MAX] = EOS;
+	(void) strncpy (host, hostport, PATH_MAX);
+	port = strrchr (host, ':');
+	if (port != NULL)
+	{
+		*port++ = EOS;
+	}
+	else
+	{
+		port = "514";
+	}
+	(void) memset (&hints, 0, sizeof (hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = socktype;
+	status = getaddrinfo (host, port, &hints, &ai);
+	if (status != 0)
+	{
+		(void) fprintf (stderr, "Cannot resolve %s: %s\n", hostport,
+			gai_strerror (status));
+		return (NULL);
+	}
+	return (ai);
+}
+
+/* Connected to the stream target. Writes do not wait, they stop when
+   the socket takes no more and the rest is written from the main loop
+   once it is writable again. The connection is watched for being closed
+   by the other end. */
+
+void
+connected_sink (void)
+{
+	int on;
+
+	on = 1;
+	(void) setsockopt (sink.fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof (on));
+	if (verbose)
+	{
+		printf ("Connected to %s\n", target);
+	}
+	sink.connecting = false;
+	sink.backoff = 1;
+	watch_fd (sink.fd, EPOLLIN|EPOLLRDHUP);
+}
+
+/* Connecting to the stream target failed, try again after a delay
+   doubling up to a limit. */
+
+void
+connect_failed (int err)
+{
+	if (sink.fd != -1)
+	{
+		(void) close (sink.fd);
+		sink.fd = -1;
+	}
+	sink.connecting = false;
+	(void) fprintf (stderr, "Cannot connect to %s: %s, retry in %d s\n",
+		target, strerror (err), sink.backoff);
+	sink.retry = time (NULL) + sink.backoff;
+	sink.backoff *= 2;
+	if (sink.backoff > BACKOFF_MAX)
+	{
+		sink.backoff = BACKOFF_MAX;
+	}
+}
+
+/* Connect to the stream target. The connection is made without
+   waiting, the event loop finishes it, or it is given up after a
+   while. Return whether connected. */
+
+int
+connect_sink (void)
+{
+	struct addrinfo *ai;
+	int status;
+	int err;
+
+	/* Being connected, or not yet time to try again. */
+	if (sink.connecting)
+	{
+		if (time (NULL) >= sink.connectby)
+		{
+			connect_failed (ETIMEDOUT);
+		}
+		return (false);
+	}
+	if (time (NULL) < sink.retry)
+	{
+		return (false);
+	}
+
+	/* Start connecting. */
+	err = EHOSTUNREACH;
+	status = -1;
+	ai = resolve (target + 4, SOCK_STREAM);
+	if (ai != NULL)
+	{
+		sink.fd = socket (ai->ai_family,
+			ai->ai_socktype|SOCK_CLOEXEC|SOCK_NONBLOCK, ai->ai_protocol);
+		if (sink.fd == -1)
+		{
+			err = errno;
+		}
+		else
+		{
+			status = connect (sink.fd, ai->ai_addr, ai->ai_addrlen);
+			err = (status == -1) ? errno : 0;
+		}
+		freeaddrinfo (ai);
+	}
+	if (status == 0)
+	{
+		connected_sink ();
+		return (true);
+	}
+	if (err == EINPROGRESS)
+	{
+		sink.connecting = true;
+		sink.connectby = time (NULL) + CONNECT_TIMEOUT;
+		watch_fd (sink.fd, EPOLLOUT);
+		return (false);
+	}
+	connect_failed (err);
+	return (false);
+}
+
+/* Spool file in the log directory. Messages the target cannot take are
+   appended to it, and all that follow until it is drained, so they keep
+   their order. The file is mapped into memory and survives a restart. */
+#define SPOOL_NAME "logforw.spool"
+
+/* Spool file header, the messages follow from SPOOL_DATA on, each as
+   its length and the bytes. */
+#define SPOOL_MAGIC "LFSPOOL1"
+#define SPOOL_DATA ((uint64_t) 64)
+typedef struct
+{
+	char magic[8];
+
+	/* Offsets of the next message to send and of the end. */
+	uint64_t read;
+	uint64_t write;
+} spoolhead_t;
+
+/* Spool state. */
+typedef struct
+{
+
+	/* File mapped, NULL if not in use. */
+	char *map;
+	spoolhead_t *head;
+	size_t size;
+
+	/* Message assembled for the spool. */
+	char *message;
+
+	/* Time the spool started to fill, nanoseconds. */
+	unsigned long since;
+
+	/* Messages spooled, drained and dropped with the spool full. */
+	unsigned long spooled;
+	unsigned long drained;
+	unsigned long dropped;
+} spool_t;
+
+/* The spool. */
+spool_t spool;
+
+/* Size of the spool file, zero for none. */
+size_t spoolsize = 0;
+
+/* Open and map the spool file. Messages left from before are kept. */
+
+void
+open_spool (void)
+{
+	char logcopy[PATH_MAX+1];
+	char path[PATH_MAX+1];
+	spoolhead_t *h;
+	int fd;
+
+	spool.map = NULL;
+	if (spoolsize == 0 || sinktype == SINK_SYSLOG)
+	{
+		return;
+	}
+	logcopy[PATH_MAX] = EOS;
+	(void) strncpy (logcopy, logfilename, PATH_MAX);
+	(void) snprintf (path, sizeof (path), "%s/%s", dirname (logcopy),
+		SPOOL_NAME);
+	fd = open (path, O_RDWR|O_CREAT|O_CLOEXEC, (mode_t) 0600);
+	if (fd == -1 || ftruncate (fd, (off_t) spoolsize) == -1)
+	{
+		(void) fprintf (stderr, "Spool file is %s\n", path);
+		perror ("Error context");
+		error ("Cannot create spool file");
+	}
+	spool.map = (char *) mmap (NULL, spoolsize, PROT_READ|PROT_WRITE,
+		MAP_SHARED, fd, (off_t) 0);
+	if (spool.map == (char *) MAP_FAILED)
+	{
+		perror ("Error context");
+		error ("Cannot map spool file");
+	}
+	(void) close (fd);
+	spool.size = spoolsize;
+	spool.head = h = (spoolhead_t *) spool.map;
+	spool.message = (char *) allocate (HEADER_MAX + LINELENGTH_MAX +
+		PATH_MAX + 2);
+	spool.since = now_ns ();
+
+	/* Start empty unless there is a valid spool from before. */
+	if (memcmp (h->magic, SPOOL_MAGIC, sizeof (h->magic)) != 0 ||
+		h->read < SPOOL_DATA || h->read > h->write || h->write > spool.size)
+	{
+		(void) memcpy (h->magic, SPOOL_MAGIC, sizeof (h->magic));
+		h->read = SPOOL_DATA;
+		h->write = SPOOL_DATA;
+	}
+	else if (h->read < h->write)
+	{
+		(void) fprintf (stderr, "Spool holds %lu bytes from before\n",
+			(unsigned long) (h->write - h->read));
+	}
+}
+
+/* Whether messages are waiting in the spool. */
+
+int
+spool_pending (void)
+{
+	return (spool.map != NULL && spool.head->read < spool.head->write);
+}
+
+/* Append message to the spool. The space of the messages sent is taken
+   back when the end is reached. Return false if there is no room. */
+
+int
+spool_put (char *msg, size_t size)
+{
+	spoolhead_t *h;
+	uint32_t length;
+
+	h = spool.head;
+	if (h->write + sizeof (length) + size > spool.size &&
+		h->read > SPOOL_DATA)
+	{
+		(void) memmove (spool.map + SPOOL_DATA, spool.map + h->read,
+			(size_t) (h->write - h->read));
+		h->write -= h->read - SPOOL_DATA;
+		h->read = SPOOL_DATA;
+	}
+	if (h->write + sizeof (length) + size > spool.size)
+	{
+		spool.dropped++;
+		sink.dropped++;
+		sink.unreported++;
+		return (false);
+	}
+	if (h->read == h->write)
+	{
+		spool.since = now_ns ();
+	}
+	length = (uint32_t) size;
+	(void) memcpy (spool.map + h->write, &length, sizeof (length));
+	(void) memcpy (spool.map + h->write + sizeof (length), msg, size);
+	h->write += sizeof (length) + size;
+	spool.spooled++;
+	return (true);
+}
+
+/* Print the use of the spool. */
+
+void
+print_spool (void)
+{
+	if (spool.map == NULL)
+	{
+		return;
+	}
+	printf ("Spool of %lu bytes holds %lu, spooled %lu, drained %lu, "
+		"dropped %lu\n", (unsigned long) spool.size,
+		(unsigned long) (spool.head->write - spool.head->read),
+		spool.spooled, spool.drained, spool.dropped);
+}
+
+/* Open the socket of the direct transport. The target is unix:path,
+   udp:host:port or tcp:host:port. */
+
+void
+open_sink (void)
+{
+	struct sockaddr_un sun;
+	struct addrinfo *ai;
+	int status;
+
+	sink.fd = -1;
+	sink.count = 0;
+	sink.used = 0;
+	sink.done = 0;
+	sink.blocked = false;
+	sink.retry = (time_t) 0;
+	sink.backoff = 1;
+	sink.connecting = false;
+	sink.headertime = (time_t) 0;
+	sink.hostname[0] = EOS;
+	if (sinktype == SINK_SYSLOG)
+	{
+		return;
+	}
+	sink.buffer = (char *) allocate (BATCH_SIZE);
+	if (strncmp (target, "unix:", 5) == 0)
+	{
+
+		/* Local syslog socket. */
+		sinktype = SINK_DGRAM;
+		sink.fd = socket (AF_UNIX, SOCK_DGRAM|SOCK_CLOEXEC, 0);
+		if (sink.fd == -1)
+		{
+			perror ("Error context");
+			error ("Cannot create socket");
+		}
+		(void) memset (&sun, 0, sizeof (sun));
+		sun.sun_family = AF_UNIX;
+		(void) strncpy (sun.sun_path, target + 5, sizeof (sun.sun_path) - 1);
+		(void) memcpy (&sink.addr, &sun, sizeof (sun));
+		sink.addrlen = sizeof (sun);
+		status = connect (sink.fd, (struct sockaddr *) &sun, sizeof (sun));
+	}
+	else if (strncmp (target, "udp:", 4) == 0)
+	{
+
+		/* Remote syslog server. */
+		sinktype = SINK_DGRAM;
+		ai = resolve (target + 4, SOCK_DGRAM);
+		if (ai == NULL)
+		{
+			error ("Cannot resolve target");
+		}
+		sink.fd = socket (ai->ai_family, ai->ai_socktype|SOCK_CLOEXEC,
+			ai->ai_protocol);
+		if (sink.fd == -1)
+		{
+			perror ("Error context");
+			error ("Cannot create socket");
+		}
+		(void) memcpy (&sink.addr, ai->ai_addr, ai->ai_addrlen);
+		sink.addrlen = ai->ai_addrlen;
+		status = connect (sink.fd, ai->ai_addr, ai->ai_addrlen);
+		freeaddrinfo (ai);
+	}
+	else if (strncmp (target, "tcp:", 4) == 0)
+	{
+
+		/* Remote collector, connected when there is data to send. */
+		sinktype = SINK_STREAM;
+		status = 0;
+	}
+	else
+	{
+		(void) fprintf (stderr, "Target is %s\n", target);
+		error ("Target should be unix:path, udp:host:port or tcp:host:port");
+	}
+	if (status == -1)
+	{
+		(void) fprintf (stderr, "Cannot connect to %s\n", target);
+		perror ("Error context");
+		error ("Cannot connect to target");
+	}
+
+	/* Remote targets get the host name in the header. */
+	if (strncmp (target, "unix:", 5) != 0)
+	{
+		(void) gethostname (sink.hostname, sizeof (sink.hostname));
+		sink.hostname[HOST_NAME_MAX] = EOS;
+	}
+	open_spool ();
+}
+
+/* Build the message header for the current second. */
+
+void
+build_header (time_t now)
+{
+	struct tm tm;
+	char stamp[64];
+	int n;
+
+	if (rfcformat == 5424)
+	{
+		(void) gmtime_r (&now, &tm);
+		(void) strftime (stamp, sizeof (stamp), "%Y-%m-%dT%H:%M:%SZ", &tm);
+		n = snprintf (sink.header, sizeof (sink.header),
+			"<%d>1 %s %s %s %ld - - ", facilitycode|LOG_INFO, stamp,
+			(sink.hostname[0] == EOS) ? "-" : sink.hostname, facility,
+			(long) getpid ());
+	}
+	else
+	{
+		(void) localtime_r (&now, &tm);
+		(void) strftime (stamp, sizeof (stamp), "%b %e %H:%M:%S", &tm);
+		n = snprintf (sink.header, sizeof (sink.header),
+			"<%d>%s %s%s%s[%ld]: ", facilitycode|LOG_INFO, stamp,
+			sink.hostname, (sink.hostname[0] == EOS) ? "" : " ",
+			facility, (long) getpid ());
+	}
+	sink.headerlength = (n < 0 || n >= HEADER_MAX) ? HEADER_MAX - 1 : n;
+	sink.headertime = now;
+}
+
+/* Report messages dropped. */
+
+void
+report_drops (void)
+{
+	if (sink.unreported > 0)
+	{
+		(void) fprintf (stderr, "Dropped %lu messages for %s\n",
+			sink.unreported, target);
+		sink.unreported = 0;
+	}
+}
+
+/* Datagrams are not taken, the spool is tried again after a delay
+   doubling up to a limit. */
+
+void
+retry_later (void)
+{
+	perror ("Error sending to syslog");
+	sink.retry = time (NULL) + sink.backoff;
+	sink.backoff *= 2;
+	if (sink.backoff > BACKOFF_MAX)
+	{
+		sink.backoff = BACKOFF_MAX;
+	}
+}
+
+/* The target takes no more for now. Sending waits for the socket to be
+   writable, a datagram socket is only watched until it is. */
+
+void
+wait_writable (void)
+{
+	sink.blocked = true;
+	atomic_store (&sinkbusy, spool.map == NULL);
+	if (sinktype == SINK_STREAM)
+	{
+		watch_fd (sink.fd, EPOLLIN|EPOLLRDHUP|EPOLLOUT);
+	}
+	else
+	{
+		watch_fd (sink.fd, EPOLLOUT|EPOLLONESHOT);
+	}
+}
+
+/* The target takes data again. */
+
+void
+sink_writable (void)
+{
+	sink.blocked = false;
+	atomic_store (&sinkbusy, false);
+	if (sinktype == SINK_STREAM)
+	{
+		watch_fd (sink.fd, EPOLLIN|EPOLLRDHUP);
+	}
+}
+
+/* Wait for a busy target to take more, as long as there is time left
+   on this pass. Return whether it does. */
+
+int
+wait_sink (void)
+{
+	struct pollfd pfd;
+	unsigned long start;
+	int n;
+
+	if (sinkwait <= 0)
+	{
+		return (false);
+	}
+	pfd.fd = sink.fd;
+	pfd.events = POLLOUT;
+	start = now_ms ();
+	n = poll (&pfd, 1, (int) sinkwait);
+	sinkwait -= (long) (now_ms () - start);
+	if (n != 1)
+	{
+		return (false);
+	}
+	sink_writable ();
+	return (true);
+}
+
+/* Take the frames written in full out of the stream data, the one
+   partly written stays first. */
+
+void
+drop_written (void)
+{
+	size_t start;
+	size_t next;
+
+	start = 0;
+	while (start < sink.done)
+	{
+		next = start + strtoul (sink.buffer + start, NULL, 10);
+		next += strcspn (sink.buffer + start, " ") + 1;
+		if (next > sink.done)
+		{
+			break;
+		}
+		start = next;
+	}
+	(void) memmove (sink.buffer, sink.buffer + start, sink.used - start);
+	sink.used -= start;
+	sink.done -= start;
+}
+
+/* Write the stream data without waiting. What the target does not take
+   yet is written when the socket is writable, meanwhile the buffer
+   fills up and then the spool. If the connection fails the frames not
+   written in full are kept and written again after reconnecting. */
+
+void
+flush_stream (void)
+{
+	unsigned long began;
+	ssize_t n;
+
+	if (sink.used == 0 || sink.blocked)
+	{
+		return;
+	}
+	if ((sink.fd == -1 || sink.connecting) && ! connect_sink ())
+	{
+		return;
+	}
+	while (sink.done < sink.used)
+	{
+		began = now_ns ();
+		n = send (sink.fd, sink.buffer + sink.done, sink.used - sink.done,
+			MSG_NOSIGNAL|MSG_DONTWAIT);
+		count_send (began);
+		if (n == (ssize_t) -1)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+			{
+
+				/* Make room once half the buffer is written. */
+				if (sink.done > BATCH_SIZE / 2)
+				{
+					drop_written ();
+				}
+				wait_writable ();
+				return;
+			}
+			(void) fprintf (stderr, "Error sending to %s: %s\n", target,
+				strerror (errno));
+			(void) close (sink.fd);
+			sink.fd = -1;
+			sink.retry = time (NULL) + sink.backoff;
+
+			/* Keep the frames from the one partly written on. */
+			drop_written ();
+			sink.done = 0;
+			return;
+		}
+		sink.done += (size_t) n;
+	}
+	sink.used = 0;
+	sink.done = 0;
+	report_drops ();
+}
+
+/* Send the messages in the spool, as fast as the target takes them.
+   On a stream they are framed into the stream data, datagrams are sent
+   straight from the spool. */
+
+void
+drain_spool (void)
+{
+	unsigned long start;
+	spoolhead_t *h;
+	uint32_t length;
+	uint64_t pos;
+	int count;
+	int sent;
+	int i;
+
+	if (! spool_pending ())
+	{
+		return;
+	}
+	h = spool.head;
+	if (sinktype == SINK_STREAM)
+	{
+		while (h->read < h->write)
+		{
+			(void) memcpy (&length, spool.map + h->read, sizeof (length));
+			if (sink.used + length + 24 > BATCH_SIZE)
+			{
+				flush_stream ();
+				if (sink.used > 0)
+				{
+					return;
+				}
+			}
+			sink.used += (size_t) sprintf (sink.buffer + sink.used, "%lu ",
+				(unsigned long) length);
+			(void) memcpy (sink.buffer + sink.used,
+				spool.map + h->read + sizeof (length), (size_t) length);
+			sink.used += (size_t) length;
+			h->read += sizeof (length) + length;
+			spool.drained++;
+			sink.sent++;
+		}
+		flush_stream ();
+	}
+	else
+	{
+
+		/* Not yet time to try again. A local receiver restarted has
+		   a new socket. */
+		if (time (NULL) < sink.retry)
+		{
+			return;
+		}
+		(void) connect (sink.fd, (struct sockaddr *) &sink.addr,
+			sink.addrlen);
+		while (h->read < h->write)
+		{
+			pos = h->read;
+			for (count=0; count<BATCH_MAX && pos<h->write; count++)
+			{
+				(void) memcpy (&length, spool.map + pos, sizeof (length));
+				sink.iov[count].iov_base = spool.map + pos + sizeof (length);
+				sink.iov[count].iov_len = (size_t) length;
+				(void) memset (&sink.msgs[count], 0, sizeof (struct mmsghdr));
+				sink.msgs[count].msg_hdr.msg_iov = &sink.iov[count];
+				sink.msgs[count].msg_hdr.msg_iovlen = 1;
+				pos += sizeof (length) + length;
+			}
+			start = now_ns ();
+			sent = sendmmsg (sink.fd, sink.msgs, (unsigned int) count,
+				MSG_DONTWAIT);
+			count_send (start);
+			if (sent == -1)
+			{
+				if (errno == EINTR)
+				{
+					continue;
+				}
+				if (errno == EAGAIN || errno == EWOULDBLOCK)
+				{
+					wait_writable ();
+					return;
+				}
+				retry_later ();
+				return;
+			}
+			for (i=0; i<sent; i++)
+			{
+				h->read += sizeof (length) + sink.iov[i].iov_len;
+			}
+			spool.drained += (unsigned long) sent;
+			sink.sent += (unsigned long) sent;
+		}
+		sink.backoff = 1;
+	}
+
+	/* Empty again, start from the beginning. */
+	if (h->read == h->write)
+	{
+		(void) fprintf (stderr, "Spool drained in %.3f s\n",
+			(double) (now_ns () - spool.since) / 1e9);
+		h->read = SPOOL_DATA;
+		h->write = SPOOL_DATA;
+		report_drops ();
+	}
+}
+
+/* Send the messages of the batch. Sending does not wait, the messages
+   a busy receiver does not take are spooled if there is a spool,
+   otherwise kept in the batch until it takes them. */
+
+void
+flush_sink (void)
+{
+	unsigned long start;
+	int sent;
+	int first;
+	int i;
+
+	if (sinktype == SINK_STREAM)
+	{
+		flush_stream ();
+		if (sink.used == 0)
+		{
+			drain_spool ();
+		}
+		return;
+	}
+	if (sink.blocked)
+	{
+		return;
+	}
+	drain_spool ();
+	if (sink.blocked)
+	{
+		return;
+	}
+	first = 0;
+	while (first < sink.count)
+	{
+		start = now_ns ();
+		sent = sendmmsg (sink.fd, sink.msgs + first,
+			(unsigned int) (sink.count - first), MSG_DONTWAIT);
+		count_send (start);
+		if (sent == -1)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+
+			/* Receiver busy, the rest waits in the batch until it takes
+			   more, unless there is a spool. */
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+			{
+				wait_writable ();
+				if (spool.map == NULL)
+				{
+					for (i=first; i<sink.count; i++)
+					{
+						sink.iov[i - first] = sink.iov[i];
+						sink.msgs[i - first].msg_hdr.msg_iov =
+							&sink.iov[i - first];
+					}
+					sink.count -= first;
+					return;
+				}
+			}
+			else if (spool.map != NULL)
+			{
+				retry_later ();
+			}
+
+			/* The rest of the batch is spooled if there is a spool,
+			   otherwise lost. */
+			if (spool.map != NULL)
+			{
+				for (; first<sink.count; first++)
+				{
+					(void) spool_put (sink.iov[first].iov_base,
+						sink.iov[first].iov_len);
+				}
+				break;
+			}
+			perror ("Error sending to syslog");
+			sink.dropped += (unsigned long) (sink.count - first);
+			sink.unreported += (unsigned long) (sink.count - first);
+			break;
+		}
+		sink.sent += (unsigned long) sent;
+		first += sent;
+	}
+	if (first == sink.count && ! spool_pending ())
+	{
+		report_drops ();
+	}
+	sink.count = 0;
+	sink.used = 0;
+}
+
+/* Assemble a message, the header, the prefix and the text, separated
+   by a colon if there is a prefix. Return its size. */
+
+size_t
+format_message (char *p, char *prefix, int prefixlength, char *text,
+	long length)
+{
+	size_t size;
+
+	(void) memcpy (p, sink.header, sink.headerlength);
+	size = sink.headerlength;
+	if (prefixlength > 0)
+	{
+		(void) memcpy (p + size, prefix, (size_t) prefixlength);
+		size += (size_t) prefixlength;
+		p[size++] = ':';
+		p[size++] = ' ';
+	}
+	(void) memcpy (p + size, text, (size_t) length);
+	size += (size_t) length;
+	return (size);
+}
+
+/* Put message into the batch. The message is the prefix and the text,
+   separated by a colon if there is a prefix. On a stream each message
+   is preceded by its length. */
+
+void
+put_sink (char *prefix, int prefixlength, char *text, long length)
+{
+	time_t now;
+	char *p;
+	size_t size;
+	size_t needed;
+	int n;
+
+	/* Header changes by the second. */
+	now = time (NULL);
+	if (now != sink.headertime)
+	{
+		build_header (now);
+	}
+	size = sink.headerlength + (size_t) length;
+	if (prefixlength > 0)
+	{
+		size += (size_t) prefixlength + 2;
+	}
+
+	/* Behind messages waiting in the spool. */
+	if (spool_pending ())
+	{
+		(void) spool_put (spool.message, format_message (spool.message,
+			prefix, prefixlength, text, length));
+		return;
+	}
+
+	/* Make room. */
+	needed = size + 24;
+	if (sink.count == BATCH_MAX || sink.used + needed > BATCH_SIZE)
+	{
+		flush_sink ();
+	}
+
+	/* Without a spool a busy target is given a while to take more. The
+	   readers hold back the lines meanwhile, these were read before. */
+	while ((sink.count == BATCH_MAX || sink.used + needed > BATCH_SIZE) &&
+		sink.blocked && spool.map == NULL && wait_sink ())
+	{
+		flush_sink ();
+	}
+	if (sink.count == BATCH_MAX || sink.used + needed > BATCH_SIZE ||
+		spool_pending ())
+	{
+
+		/* Target is not reachable or busy and the buffer is full,
+		   or the batch was just spooled. */
+		if (spool.map != NULL)
+		{
+			(void) spool_put (spool.message, format_message (spool.message,
+				prefix, prefixlength, text, length));
+			return;
+		}
+		sink.dropped++;
+		sink.unreported++;
+		return;
+	}
+
+	/* Frame length on a stream. */
+	p = sink.buffer + sink.used;
+	if (sinktype == SINK_STREAM)
+	{
+		n = sprintf (p, "%lu ", (unsigned long) size);
+		p += n;
+		sink.used += (size_t) n;
+	}
+
+	/* Assemble the message. */
+	size = format_message (p, prefix, prefixlength, text, length);
+	sink.used += size;
+	if (sinktype == SINK_STREAM)
+	{
+		sink.sent++;
+		return;
+	}
+
+	/* Add to the batch. */
+	sink.iov[sink.count].iov_base = p;
+	sink.iov[sink.count].iov_len = size;
+	(void) memset (&sink.msgs[sink.count], 0, sizeof (struct mmsghdr));
+	sink.msgs[sink.count].msg_hdr.msg_iov = &sink.iov[sink.count];
+	sink.msgs[sink.count].msg_hdr.msg_iovlen = 1;
+	sink.count++;
+
+	/* Send a full batch right away, the readers see a busy target
+	   before they read more. */
+	if (sink.count == BATCH_MAX)
+	{
+		flush_sink ();
+	}
+}
+
+/* Log a message of our own. */
+
+void
+log_message (char *msg)
+{
+	if (sinktype == SINK_SYSLOG)
+	{
+		syslog (LOG_INFO, "%s", msg);
+	}
+	else
+	{
+		put_sink ("", 0, msg, (long) strlen (msg));
+		flush_sink ();
+	}
+}
+
+/* Reader state, owned by the loop forwarding the files. The buffers
+   are allocated once and reused for all files. */
+typedef struct
+{
+
+	/* Chunk read from a file. */
+	char *chunk;
+	size_t chunksize;
+
+	/* Lines collected for the sender, NULL if forwarded as read. */
+	char *out;
+	size_t outused;
+
+	/* Name of the file read, recorded ahead of its lines. */
+	char *prefix;
+	int prefixlength;
+
+	/* File read and number of files held back by the rate limits. */
+	file_t *file;
+	int ndeferred;
+
+	/* Counters of the thread. */
+	counters_t *counters;
+
+	/* Time spent waiting for room in the ring, nanoseconds. */
+	atomic_ulong stalled;
+} reader_t;
+
+/* Lines passed from the reader threads to the sender at a time. A
+   buffer holds at least one line of maximum length. */
+#define SLOT_SIZE ((size_t) 65536)
+
+/* Number of buffers in the ring, a power of two. */
+#define RING_SLOTS 128
+
+/* Ring buffer slot. The sequence number tells whether the slot is free
+   for the position being written or full for the one being read. */
+typedef struct
+{
+	atomic_size_t sequence;
+	char *data;
+	size_t used;
+} slot_t;
+
+/* Bounded ring of buffers from the reader threads, the producers, to
+   the main thread sending the lines, the consumer. A reader claims a
+   position with compare and swap and exchanges its buffer with the one
+   in the slot, the lines are never copied. When the ring is full the
+   readers wait for the sender. */
+typedef struct
+{
+	slot_t *slots;
+
+	/* Next position to write, shared by the producers. */
+	_Alignas (64) atomic_size_t head;
+
+	/* Next position to read, owned by the consumer. */
+	_Alignas (64) size_t tail;
+
+	/* Most slots full at a time. */
+	size_t highwater;
+} ring_t;
+
+/* The ring, used with reader threads only. */
+ring_t ring;
+
+/* Wait a little while polling the ring. Yield at first, then sleep. */
+
+void
+ring_pause (int spins)
+{
+	struct timespec ts;
+
+	if (spins < 64)
+	{
+		(void) sched_yield ();
+	}
+	else
+	{
+		ts.tv_sec = 0;
+		ts.tv_nsec = 100000;
+		(void) nanosleep (&ts, NULL);
+	}
+}
+
+/* Allocate the ring. */
+
+void
+init_ring (void)
+{
+	int i;
+
+	ring.slots = (slot_t *) allocate (RING_SLOTS * sizeof (slot_t));
+	for (i=0; i<RING_SLOTS; i++)
+	{
+		atomic_init (&ring.slots[i].sequence, (size_t) i);
+		ring.slots[i].data = (char *) allocate (SLOT_SIZE);
+		ring.slots[i].used = 0;
+	}
+	atomic_init (&ring.head, (size_t) 0);
+	ring.tail = 0;
+	ring.highwater = 0;
+}
+
+/* Pass the lines collected by a reader to the sender. */
+
+void
+put_ring (reader_t *r)
+{
+	slot_t *slot;
+	size_t pos;
+	size_t seq;
+	char *data;
+	unsigned long start;
+	int spins;
+
+	start = 0;
+	spins = 0;
+	pos = atomic_load_explicit (&ring.head, memory_order_relaxed);
+	while (true)
+	{
+		slot = &ring.slots[pos & (RING_SLOTS - 1)];
+		seq = atomic_load_explicit (&slot->sequence, memory_order_acquire);
+		if (seq == pos)
+		{
+
+			/* Free, claim it. */
+			if (atomic_compare_exchange_weak_explicit (&ring.head, &pos,
+				pos + 1, memory_order_relaxed, memory_order_relaxed))
+			{
+				break;
+			}
+		}
+		else if ((long) (seq - pos) < 0)
+		{
+
+			/* Full, the sender is behind. */
+			if (start == 0)
+			{
+				start = now_ns ();
+			}
+			ring_pause (spins++);
+			pos = atomic_load_explicit (&ring.head, memory_order_relaxed);
+		}
+		else
+		{
+
+			/* Claimed by another reader meanwhile. */
+			pos = atomic_load_explicit (&ring.head, memory_order_relaxed);
+		}
+	}
+	if (start != 0)
+	{
+		atomic_fetch_add_explicit (&r->stalled, now_ns () - start,
+			memory_order_relaxed);
+	}
+
+	/* Exchange the buffers and publish. */
+	data = slot->data;
+	slot->data = r->out;
+	slot->used = r->outused;
+	r->out = data;
+	r->outused = 0;
+	atomic_store_explicit (&slot->sequence, pos + 1, memory_order_release);
+}
+
+/* Get the next full slot of the ring, NULL if there is none. */
+
+slot_t *
+get_ring (void)
+{
+	slot_t *slot;
+	size_t full;
+
+	slot = &ring.slots[ring.tail & (RING_SLOTS - 1)];
+	if (atomic_load_explicit (&slot->sequence, memory_order_acquire) !=
+		ring.tail + 1)
+	{
+		return (NULL);
+	}
+	full = atomic_load_explicit (&ring.head, memory_order_relaxed) -
+		ring.tail;
+	if (full > ring.highwater)
+	{
+		ring.highwater = full;
+	}
+	return (slot);
+}
+
+/* Give the slot read back to the readers. */
+
+void
+release_ring (slot_t *slot)
+{
+	atomic_store_explicit (&slot->sequence, ring.tail + RING_SLOTS,
+		memory_order_release);
+	ring.tail++;
+}
+
+/* Send one line to syslog. Prefix with file name. */
+
+void
+emit_line (char *prefix, int prefixlength, char *line, long length)
+{
+	unsigned long start;
+
+	if (verbose)
+	{
+		printf ("%.*s: %.*s\n", prefixlength, prefix, (int) length, line);
+	}
+	if (sinktype == SINK_SYSLOG)
+	{
+		start = now_ns ();
+		syslog (LOG_INFO, "%.*s: %.*s", prefixlength, prefix, (int) length,
+			line);
+		count_send (start);
+	}
+	else
+	{
+		put_sink (prefix, prefixlength, line, length);
+	}
+}
+
+/* Add a record to the lines collected, the length followed by the
+   bytes. The file name is recorded with its length negated. */
+
+void
+append (reader_t *r, long length, char *bytes, long nbytes)
+{
+	(void) memcpy (r->out + r->outused, &length, sizeof (long));
+	(void) memcpy (r->out + r->outused + sizeof (long), bytes,
+		(size_t) nbytes);
+	r->outused += sizeof (long) + (size_t) nbytes;
+}
+
+/* Collect a line. When the buffer is full it is passed to the sender
+   and the next one starts with the file name again. */
+
+void
+collect (reader_t *r, char *line, long length)
+{
+	if (r->outused + 2 * sizeof (long) + (size_t) r->prefixlength +
+		(size_t) length > SLOT_SIZE)
+	{
+		put_ring (r);
+		append (r, -(long) r->prefixlength - 1, r->prefix,
+			(long) r->prefixlength);
+	}
+	append (r, length, line, length);
+}
+
+/* Forward one line to syslog. Prefix with file name. The line is
+   passed in place by its length, it is not terminated. A reader thread
+   collects it for the sender instead. */
+
+void
+forward_line (reader_t *r, char *prefix, int prefixlength,
+	char *line, long length)
+{
+	if (r->out != NULL)
+	{
+		collect (r, line, length);
+	}
+	else
+	{
+		emit_line (prefix, prefixlength, line, length);
+	}
+}
+
+/* Send the lines collected in a buffer in order. */
+
+void
+emit_collected (char *buffer, size_t used)
+{
+	char *p;
+	char *end;
+	char *prefix;
+	int prefixlength;
+	long length;
+
+	prefix = "";
+	prefixlength = 0;
+	p = buffer;
+	end = buffer + used;
+	while (p < end)
+	{
+		(void) memcpy (&length, p, sizeof (long));
+		p += sizeof (long);
+		if (length < 0)
+		{
+
+			/* Lines of another file follow. */
+			prefix = p;
+			prefixlength = (int) (-length - 1);
+			p += prefixlength;
+		}
+		else
+		{
+			emit_line (prefix, prefixlength, p, length);
+			p += length;
+		}
+	}
+}
+
+/* What to do with a line under the rate limits. */
+#define ADMIT 0
+#define DEFER 1
+#define DROP 2
+
+/* Rate limit for all files, shared by the reader threads. */
+bucket_t globalbucket;
+pthread_mutex_t bucketmutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Take a line from a token bucket, refilled at the rates given up to a
+   second worth. A line may take more than is left, the bucket is then
+   in debt. Return whether the line can be forwarded. */
+
+int
+take (bucket_t *b, double linerate, double byterate, long length,
+	unsigned long now)
+{
+	double elapsed;
+
+	if (b->last == 0)
+	{
+		b->lines = linerate;
+		b->bytes = byterate;
+	}
+	else
+	{
+		elapsed = (double) (now - b->last) / 1e9;
+		b->lines += elapsed * linerate;
+		if (b->lines > linerate)
+		{
+			b->lines = linerate;
+		}
+		b->bytes += elapsed * byterate;
+		if (b->bytes > byterate)
+		{
+			b->bytes = byterate;
+		}
+	}
+	b->last = now;
+	if ((linerate > 0.0 && b->lines <= 0.0) ||
+		(byterate > 0.0 && b->bytes <= 0.0))
+	{
+		return (false);
+	}
+	b->lines -= 1.0;
+	b->bytes -= (double) length;
+	return (true);
+}
+
+/* Check a line against the rate limits. The position is the offset of
+   the line from the one forwarded up to. Lines are held back while the
+   file is within the lag allowed and dropped beyond it. Whatever is
+   flushed from a file rotated away is forwarded. */
+
+int
+admit (reader_t *r, long position, long length, int flush)
+{
+	file_t *f;
+	unsigned long now;
+	int ok;
+
+	f = r->file;
+	if (f == NULL || flush)
+	{
+		return (ADMIT);
+	}
+
+	/* Too far behind. */
+	if (maxlag > 0 && f->endpos - f->offset - (off_t) position > maxlag)
+	{
+		extra (f)->dropped++;
+		extra (f)->drops++;
+		add_count (&r->counters->dropped, 1UL);
+		return (DROP);
+	}
+
+	/* Target busy, the lines wait in the file. */
+	if (atomic_load_explicit (&sinkbusy, memory_order_relaxed))
+	{
+		return (DEFER);
+	}
+	if (filelines == 0.0 && filebytes == 0.0 &&
+		globallines == 0.0 && globalbytes == 0.0)
+	{
+		return (ADMIT);
+	}
+
+	/* Limit of the file, then the one for all. */
+	now = now_ns ();
+	if ((filelines > 0.0 || filebytes > 0.0) &&
+		! take (&extra (f)->bucket, filelines, filebytes, length, now))
+	{
+		return (DEFER);
+	}
+	if (globallines > 0.0 || globalbytes > 0.0)
+	{
+		(void) pthread_mutex_lock (&bucketmutex);
+		ok = take (&globalbucket, globallines, globalbytes, length, now);
+		(void) pthread_mutex_unlock (&bucketmutex);
+		if (! ok)
+		{
+
+			/* Give back what the file took. */
+			extra (f)->bucket.lines += 1.0;
+			extra (f)->bucket.bytes += (double) length;
+			return (DEFER);
+		}
+	}
+	return (ADMIT);
+}
+
+/* Report lines dropped from a file. */
+
+void
+report_dropped (file_t *f)
+{
+	char msg[PATH_MAX+64];
+	char *name;
+
+	name = strrchr (f->name, '/');
+	name = (name == NULL) ? f->name : name + 1;
+	(void) snprintf (msg, sizeof (msg), "dropped %lu lines from %s",
+		extra (f)->dropped, name);
+	log_message (msg);
+	totaldropped += extra (f)->dropped;
+	extra (f)->dropped = 0;
+}
+
+/* Forward buffer content to syslog line by line. Lines longer than the
+   limit are forwarded in pieces. Return the number of bytes forwarded,
+   an incomplete line at the end is left for the next time unless the
+   buffer is flushed, as are the lines held back by the rate limits. */
+
+long
+forward (reader_t *r, char *prefix, long nbytes, char *buffer, int flush)
+{
+	char *p;
+	char *end;
+	char *nl;
+	long limit;
+	long length;
+	long skip;
+	int prefixlength;
+	int action;
+
+	/* Line by line, the new lines are located by memchr. */
+	prefixlength = (int) strlen (prefix);
+	p = buffer;
+	end = buffer + nbytes;
+	while (p < end)
+	{
+		/* Look as far as the new line of a line of maximum length. */
+		limit = (long) (end - p);
+		if (limit > (long) LINELENGTH_MAX + 1)
+		{
+			limit = (long) LINELENGTH_MAX + 1;
+		}
+		nl = (char *) memchr (p, NL, (size_t) limit);
+		if (nl != NULL)
+		{
+
+			/* Line terminated. */
+			length = (long) (nl - p);
+			skip = length + 1;
+		}
+		else if (limit > (long) LINELENGTH_MAX)
+		{
+
+			/* Line is too long, forward what we have. */
+			length = (long) LINELENGTH_MAX;
+			skip = length;
+			add_count (&r->counters->split, 1UL);
+		}
+		else if (flush)
+		{
+
+			/* The incomplete line is flushed. */
+			length = limit;
+			skip = limit;
+		}
+		else
+		{
+
+			/* Incomplete line, left for the next time. */
+			break;
+		}
+
+		/* Forward unless held back or dropped. */
+		action = admit (r, (long) (p - buffer), length, flush);
+		if (action == DEFER)
+		{
+			r->ndeferred++;
+			r->file->throttled = true;
+			break;
+		}
+		if (action == ADMIT)
+		{
+			forward_line (r, prefix, prefixlength, p, length);
+			add_count (&r->counters->lines, 1UL);
+			add_count (&r->counters->bytes, (unsigned long) length);
+		}
+		p += skip;
+	}
+	return ((long) (p - buffer));
+}
+
+/* Forward the file from the start again. */
+
+void
+restart_file (file_t *f)
+{
+	f->offset = (off_t) 0;
+	extra (f)->head.length = 0;
+	extra (f)->tail.length = 0;
+}
+
+/* Take the fingerprint of the bytes at the offset given, false if they
+   cannot be read. */
+
+int
+take_fingerprint (int fd, off_t at, int length, fingerprint_t *fp)
+{
+	char bytes[FINGERPRINT_SIZE];
+
+	if (pread (fd, bytes, (size_t) length, at) != (ssize_t) length)
+	{
+		return (false);
+	}
+	fp->hash = hash_bytes (bytes, (size_t) length);
+	fp->length = length;
+	return (true);
+}
+
+/* Whether the bytes at the offset given have the fingerprint. */
+
+int
+same_fingerprint (int fd, off_t at, fingerprint_t *fp)
+{
+	fingerprint_t now;
+
+	if (fp->length == 0)
+	{
+		return (true);
+	}
+	return (take_fingerprint (fd, at, fp->length, &now) &&
+		now.hash == fp->hash);
+}
+
+/* Descriptor of a file to read. A reader thread finds the file opened
+   by the main thread when queued, only the main thread keeps the list
+   of open files. */
+
+int
+reader_fd (reader_t *r, file_t *f)
+{
+	if (r->out != NULL)
+	{
+		return (f->fd);
+	}
+	return (open_file (f));
+}
+
+/* Print file additions. The data added is read and forwarded in chunks,
+   an incomplete line at the end of the file is forwarded when completed
+   or when the file is flushed. */
+
+void
+print_file_change (reader_t *r, file_t *f, int flush)
+{
+	char *buffer;
+	size_t buflen;
+	ssize_t nbytes;
+	long consumed;
+	char *prefix;
+	unsigned long lines;
+	unsigned long bytes;
+	fileextra_t *x;
+
+	/* Rate limits apply unless the file is flushed. */
+	x = extra (f);
+	r->file = flush ? NULL : f;
+	f->throttled = false;
+
+	/* Contracted since checked, read it from the start. */
+	if (f->offset > f->endpos)
+	{
+		fprintf (stderr, "File %s had contracted from %lu to %lu\n",
+			f->name, (unsigned long) f->offset, (unsigned long) f->endpos);
+		restart_file (f);
+	}
+
+	/* Nothing to print. */
+	if (f->offset == f->endpos)
+	{
+		return;
+	}
+
+	/* Target busy, what is read would only be held back. The file is
+	   read again once the target takes more. */
+	if (! flush && atomic_load_explicit (&sinkbusy, memory_order_relaxed))
+	{
+		r->ndeferred++;
+		f->throttled = true;
+		return;
+	}
+
+	/* The file is kept open, it is read from the last position. */
+	if (reader_fd (r, f) == -1)
+	{
+		fprintf (stderr, "Error opening %s\n", f->name);
+		perror ("Error context");
+		error ("Cannot open file to print changes");
+	}
+
+	/* Lines are prefixed with the last component of the file name. */
+	prefix = strrchr (f->name, '/');
+	prefix = (prefix == NULL) ? f->name : prefix + 1;
+	if (r->out != NULL)
+	{
+		r->prefix = prefix;
+		r->prefixlength = (int) strlen (prefix);
+		if (r->outused + sizeof (long) + (size_t) r->prefixlength >
+			SLOT_SIZE)
+		{
+			put_ring (r);
+		}
+		append (r, -(long) r->prefixlength - 1, prefix,
+			(long) r->prefixlength);
+	}
+
+	/* Read and forward chunk by chunk into the reusable buffer. */
+	buffer = reserve (&r->chunk, &r->chunksize, CHUNK_SIZE);
+	lines = atomic_load_explicit (&r->counters->lines, memory_order_relaxed);
+	bytes = atomic_load_explicit (&r->counters->bytes, memory_order_relaxed);
+	while (f->offset < f->endpos)
+	{
+		buflen = CHUNK_SIZE;
+		if ((off_t) buflen > f->endpos - f->offset)
+		{
+			buflen = (size_t) (f->endpos - f->offset);
+		}
+		nbytes = pread (f->fd, buffer, buflen, f->offset);
+		if (nbytes == (ssize_t) -1)
+		{
+			fprintf (stderr, "Error reading %s\n", f->name);
+			perror ("Error context");
+			error ("Cannot read from file to print changes");
+		}
+		if (nbytes != (ssize_t) buflen)
+		{
+
+			/* Truncated since the check, forward what is there. */
+			fprintf (stderr, "Error reading %s - partial read\n", f->name);
+			f->endpos = f->offset + (off_t) nbytes;
+		}
+
+		/* Forward buffer content to syslog. The rest of the file is
+		   flushed together with the last chunk. */
+		consumed = forward (r, prefix, (long) nbytes, buffer,
+			flush && f->offset + (off_t) nbytes == f->endpos);
+		f->offset += (off_t) consumed;
+		if (consumed > 0)
+		{
+			x->tail.length = (consumed < FINGERPRINT_SIZE) ? (int) consumed :
+				FINGERPRINT_SIZE;
+			x->tail.hash = hash_bytes (buffer + consumed - x->tail.length,
+				(size_t) x->tail.length);
+		}
+		if (consumed == 0 || f->throttled)
+		{
+
+			/* Incomplete line, wait for the rest, or held back. */
+			break;
+		}
+	}
+	x->lines += atomic_load_explicit (&r->counters->lines,
+		memory_order_relaxed) - lines;
+	x->bytes += atomic_load_explicit (&r->counters->bytes,
+		memory_order_relaxed) - bytes;
+
+	/* Fingerprint the start as soon as there is some read. */
+	if (x->head.length < FINGERPRINT_SIZE && f->offset > x->head.length)
+	{
+		(void) take_fingerprint (f->fd, (off_t) 0,
+			(f->offset < FINGERPRINT_SIZE) ? (int) f->offset :
+			FINGERPRINT_SIZE, &x->head);
+	}
+}
+
+/* Forward the rest of an open file whose name refers to another file
+   or to none by now, then close it. */
+
+void
+drain_file (reader_t *r, file_t *f)
+{
+	filestat_t fs;
+
+	if (f->fd == -1)
+	{
+		return;
+	}
+	if (fstat_file (f->fd, &fs) == 0)
+	{
+		f->endpos = fs.size;
+		print_file_change (r, f, true);
+	}
+	close_file (f);
+}
+
+/* Check the start of a file forwarded from before against its
+   fingerprint, taking the fingerprints as far as the offset allows
+   while at it. Return false if the file was written again from the
+   start since. */
+
+int
+check_head (file_t *f)
+{
+	int length;
+	fileextra_t *x;
+
+	x = extra (f);
+	if (f->offset == 0 || open_file (f) == -1)
+	{
+		return (true);
+	}
+	if (! same_fingerprint (f->fd, (off_t) 0, &x->head))
+	{
+		return (false);
+	}
+	length = (f->offset < FINGERPRINT_SIZE) ? (int) f->offset :
+		FINGERPRINT_SIZE;
+	if (x->head.length < length)
+	{
+		(void) take_fingerprint (f->fd, (off_t) 0, length, &x->head);
+	}
+	if (x->tail.length == 0)
+	{
+		(void) take_fingerprint (f->fd, f->offset - length, length,
+			&x->tail);
+	}
+	return (true);
+}
+
+/* Find what the file was before it was rotated in its directory: the
+   same file under another name or, with copy, another file with the
+   same start and the same bytes before the offset forwarded up to, as
+   made by copytruncate rotation. Return a descriptor open for it or -1. */
+
+int
+find_rotated (file_t *f, int copy)
+{
+	char dircopy[PATH_MAX+1];
+	struct dirent *e;
+	struct stat st;
+	DIR *d;
+	int fd;
+	fileextra_t *x;
+
+	x = extra (f);
+	dircopy[PATH_MAX] = EOS;
+	(void) strncpy (dircopy, f->name, PATH_MAX);
+	d = opendir (dirname (dircopy));
+	if (d == NULL)
+	{
+		return (-1);
+	}
+	fd = -1;
+	while (fd == -1 && (e = readdir (d)) != NULL)
+	{
+		if (e->d_type == DT_DIR ||
+			fstatat (dirfd (d), e->d_name, &st, 0) == -1 ||
+			! S_ISREG (st.st_mode) || st.st_dev != f->dev ||
+			(st.st_ino == f->ino) == copy || st.st_size < f->offset)
+		{
+			continue;
+		}
+		fd = openat (dirfd (d), e->d_name, O_RDONLY|O_CLOEXEC);
+		if (fd != -1 && copy &&
+			! (same_fingerprint (fd, (off_t) 0, &x->head) &&
+			same_fingerprint (fd, f->offset - x->tail.length, &x->tail)))
+		{
+			(void) close (fd);
+			fd = -1;
+		}
+		else if (fd != -1 && verbose)
+		{
+			printf ("Rotated %s found as %s\n", f->name, e->d_name);
+		}
+	}
+	(void) closedir (d);
+	return (fd);
+}
+
+/* Forward what a truncated file had not forwarded yet from its copy,
+   if one is found. */
+
+void
+drain_copy (reader_t *r, file_t *f)
+{
+	filestat_t fs;
+	int fd;
+	int n;
+	fileextra_t *x;
+
+	x = extra (f);
+	if (f->offset == 0 || x->head.length == 0 || x->tail.length == 0)
+	{
+		return;
+	}
+	fd = find_rotated (f, true);
+	if (fd == -1)
+	{
+		return;
+	}
+
+	/* A copy in the catalog already forwarded past the offset goes on
+	   by itself, otherwise the rest is forwarded here and the copy
+	   goes on from where that stopped, now or once it is found. */
+	if (fstat_file (fd, &fs) == -1)
+	{
+		(void) close (fd);
+		return;
+	}
+	n = index_get (&inodeindex, &fs, hash_inode (fs.dev, fs.ino));
+	if (n != -1 && files[n].offset >= f->offset)
+	{
+		extra (&files[n])->copyino = (ino_t) 0;
+		(void) close (fd);
+		return;
+	}
+	close_file (f);
+	keep_fd (f, fd);
+	drain_file (r, f);
+	if (n != -1)
+	{
+		files[n].offset = f->offset;
+		files[n].endpos = f->offset;
+		extra (&files[n])->head.length = 0;
+		extra (&files[n])->tail.length = 0;
+		extra (&files[n])->copyino = (ino_t) 0;
+	}
+	else
+	{
+		note_drained (fs.dev, fs.ino, f->offset);
+	}
+}
+
+/* Seconds a copy left unchanged is held back at most. */
+#define COPY_HOLD 60
+
+/* Whether the bytes of two files before the offset given are the same,
+   as far as a fingerprint tells. */
+
+int
+same_before (int fd, int otherfd, off_t at)
+{
+	fingerprint_t fp;
+	int length;
+
+	length = (at < FINGERPRINT_SIZE) ? (int) at : FINGERPRINT_SIZE;
+	return (length == 0 || (take_fingerprint (fd, at - length, length, &fp) &&
+		same_fingerprint (otherfd, at - length, &fp)));
+}
+
+/* Length of what a copy has of the file it was made from, up to the
+   size given, found by halving. Lines written to the copy may start
+   like those of the original, it is taken back to the start of the
+   line it ends in. */
+
+off_t
+copied_length (int fd, int otherfd, off_t size)
+{
+	char line[LINELENGTH_MAX];
+	off_t low;
+	off_t high;
+	off_t middle;
+	ssize_t n;
+
+	low = 0;
+	high = size;
+	while (low < high)
+	{
+		middle = high - (high - low) / 2;
+		if (same_before (fd, otherfd, middle))
+		{
+			low = middle;
+		}
+		else
+		{
+			high = middle - 1;
+		}
+	}
+	if (low == 0 || low == size)
+	{
+		return (low);
+	}
+	n = (low < LINELENGTH_MAX) ? (ssize_t) low : (ssize_t) LINELENGTH_MAX;
+	n = pread (fd, line, (size_t) n, low - (off_t) n);
+	while (n > 0 && line[n-1] != NL)
+	{
+		n--;
+		low--;
+	}
+	return (low);
+}
+
+/* Whether a new file that may be a copy is held back. One starting
+   like the file it is named after is kept up to the offset that one
+   was forwarded up to, without going back once that is truncated, the
+   rest is forwarded from it once truncated. One that starts otherwise,
+   or whose original is gone, is let go. So is one written to since it
+   was made, from the end of what was copied while the original is not
+   truncated, and one left unchanged for long. */
+
+int
+hold_copy (file_t *f, filestat_t *fs)
+{
+	filestat_t key;
+	filestat_t ofs;
+	file_t *original;
+	off_t copied;
+	int n;
+	fileextra_t *x;
+
+	x = extra (f);
+	key.dev = x->copydev;
+	key.ino = x->copyino;
+	n = index_get (&inodeindex, &key, hash_inode (key.dev, key.ino));
+	if (n == -1)
+	{
+		x->copyino = (ino_t) 0;
+		return (false);
+	}
+	original = &files[n];
+	if (fs->size >= extra (original)->head.length && open_file (f) != -1 &&
+		! same_fingerprint (f->fd, (off_t) 0, &extra (original)->head))
+	{
+		x->copyino = (ino_t) 0;
+		return (false);
+	}
+
+	/* Written to, the end is not the same as in the original. */
+	if (open_file (f) != -1 && open_file (original) != -1 &&
+		fstat_file (original->fd, &ofs) != -1 &&
+		ofs.size >= original->offset &&
+		! same_before (f->fd, original->fd, fs->size))
+	{
+		copied = copied_length (f->fd, original->fd,
+			(fs->size < ofs.size) ? fs->size : ofs.size);
+		if (copied > f->offset)
+		{
+			f->offset = copied;
+		}
+		x->copyino = (ino_t) 0;
+		return (false);
+	}
+	if (original->offset > f->offset)
+	{
+		f->offset = (fs->size < original->offset) ? fs->size :
+			original->offset;
+	}
+	if (time (NULL) - fs->mtime > COPY_HOLD)
+	{
+		x->copyino = (ino_t) 0;
+		return (false);
+	}
+	return (true);
+}
+
+/* Open a polled file not open whose name refers to another file or to
+   none by now under the name it was renamed to, if any, to forward the
+   rest of it. Renames of watched files are followed as notified. */
+
+void
+hold_rotated (file_t *f)
+{
+	int fd;
+
+	if (f->fd != -1 || f->watched)
+	{
+		return;
+	}
+	fd = find_rotated (f, false);
+	if (fd != -1)
+	{
+		keep_fd (f, fd);
+	}
+}
+
+/* Forward a file whose name is gone or refers to another file by now
+   to its end. One still under another name is noted, so that found
+   there it goes on from where it was forwarded up to. */
+
+void
+drain_rotated (reader_t *r, file_t *f)
+{
+	struct stat st;
+	int linked;
+
+	hold_rotated (f);
+	linked = (f->fd != -1 && fstat (f->fd, &st) == 0 && st.st_nlink > 0);
+	drain_file (r, f);
+	if (linked)
+	{
+		note_drained (f->dev, f->ino, f->offset);
+	}
+}
+
+/* Check if file changed. A single status call is made, by descriptor
+   for an open file whose name is known to refer to it, otherwise by
+   name. The file is not opened here, only when data added is read. */
+
+int
+check_file (reader_t *r, file_t *f)
+{
+	int status;
+	filestat_t fs;
+	off_t lastendpos;
+	int changed;
+
+	/* Get new status. */
+	if (f->fd != -1 && f->watched && ! f->moved)
+	{
+		status = fstat_file (f->fd, &fs);
+	}
+	else
+	{
+		status = stat_file (f->name, &fs);
+	}
+	f->moved = false;
+	if (status == -1)
+	{
+		if (errno == ENOENT)
+		{
+
+			/* The file was removed in the meantime and the entry should
+			   be removed as well. Forward what was written before. */
+			drain_rotated (r, f);
+			if (verbose)
+			{
+				printf ("Deregister %s\n", f->name);
+			}
+			remove_entry (f->sn);
+
+			/* Quit here prematurely, there is nothing more to do. */
+			return (false);
+		}
+
+		/* Just some other error. */
+		fprintf (stderr, "Error calling stat for %s\n", f->name);
+		perror ("Error context");
+		error ("Cannot stat file");
+	}
+
+	/* The name refers to a new file, forward the old one to the end
+	   and the new one from the start. */
+	if (fs.dev != f->dev || fs.ino != f->ino)
+	{
+		drain_rotated (r, f);
+		if (verbose)
+		{
+			printf ("New file under %s\n", f->name);
+		}
+		set_inode (f, fs.dev, fs.ino);
+		restart_file (f);
+		f->endpos = (off_t) 0;
+		f->modified = (time_t) 0;
+	}
+
+	/* Save old modified time and get current. */
+	f->lastmodified = f->modified;
+	f->modified = fs.mtime;
+
+	/* Get current end of file offset. */
+	lastendpos = f->endpos;
+	f->endpos = fs.size;
+	changed = (f->lastmodified != f->modified) || (lastendpos != f->endpos);
+
+	/* Truncated, possibly written again beyond the offset already. What
+	   was not forwarded yet may be in a copy made just before, otherwise
+	   it is gone. The file is forwarded from the start. */
+	if (fs.size < f->offset || (changed && ! check_head (f)))
+	{
+		if (verbose)
+		{
+			printf ("Truncated %s\n", f->name);
+		}
+		drain_copy (r, f);
+		restart_file (f);
+		f->endpos = fs.size;
+		changed = true;
+	}
+
+	/* A copy being made is not forwarded by itself. */
+	if (extra (f)->copyino != 0 && hold_copy (f, &fs))
+	{
+		f->endpos = f->offset;
+		changed = false;
+	}
+
+	/* Report if changed. */
+	return (changed);
+}
+
+/* Reader threads. Each file is read by the thread its device and inode
+   numbers hash to and the lines are passed through the ring to the main
+   thread sending them, so the lines of a file keep their order. */
+typedef struct
+{
+	pthread_t thread;
+	reader_t reader;
+
+	/* Files to read in this round. */
+	int *jobs;
+	int njobs;
+} worker_t;
+
+/* Reader threads, NULL when the main thread reads the files. */
+worker_t *workers = NULL;
+
+/* Files queued for the next round. At most the budget of open files
+   is queued, so none of them is closed before it is read. */
+int nqueued = 0;
+
+/* Rounds started and reader threads done with the current one. */
+unsigned long rounds = 0;
+atomic_int nfinished;
+pthread_mutex_t poolmutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t poolstart = PTHREAD_COND_INITIALIZER;
+
+/* Reader thread, reads the files queued for it each round. */
+
+void *
+run_worker (void *arg)
+{
+	worker_t *w;
+	unsigned long seen;
+	int i;
+
+	w = (worker_t *) arg;
+	seen = 0;
+	while (true)
+	{
+
+		/* Wait for the next round. */
+		(void) pthread_mutex_lock (&poolmutex);
+		while (rounds == seen)
+		{
+			(void) pthread_cond_wait (&poolstart, &poolmutex);
+		}
+		seen = rounds;
+		(void) pthread_mutex_unlock (&poolmutex);
+
+		/* Read the files and pass on what is left over. */
+		for (i=0; i<w->njobs; i++)
+		{
+			print_file_change (&w->reader, &files[w->jobs[i]], false);
+		}
+		if (w->reader.outused > 0)
+		{
+			put_ring (&w->reader);
+		}
+
+		/* Done. */
+		atomic_fetch_add_explicit (&nfinished, 1, memory_order_release);
+	}
+	return (NULL);
+}
+
+/* Start the reader threads. Signals are handled by the main thread. */
+
+void
+start_workers (void)
+{
+	sigset_t all;
+	sigset_t old;
+	worker_t *w;
+	int i;
+
+	if (nworkers <= 1)
+	{
+		return;
+	}
+	init_ring ();
+	workers = (worker_t *) allocate (nworkers * sizeof (worker_t));
+	(void) sigfillset (&all);
+	(void) pthread_sigmask (SIG_SETMASK, &all, &old);
+	for (i=0; i<nworkers; i++)
+	{
+		w = &workers[i];
+		(void) memset (w, 0, sizeof (worker_t));
+		(void) reserve (&w->reader.chunk, &w->reader.chunksize, CHUNK_SIZE);
+		w->reader.out = (char *) allocate (SLOT_SIZE);
+		atomic_init (&w->reader.stalled, 0UL);
+		w->reader.counters = &counters[i + 1];
+		w->jobs = (int *) allocate (openfiles * sizeof (int));
+		if (pthread_create (&w->thread, NULL, run_worker, w) != 0)
+		{
+			error ("Cannot create reader thread");
+		}
+	}
+	(void) pthread_sigmask (SIG_SETMASK, &old, NULL);
+}
+
+/* Print the use of the ring. */
+
+void
+print_ring (void)
+{
+	unsigned long stalled;
+	int i;
+
+	if (workers == NULL)
+	{
+		return;
+	}
+	stalled = 0;
+	for (i=0; i<nworkers; i++)
+	{
+		stalled += atomic_load_explicit (&workers[i].reader.stalled,
+			memory_order_relaxed);
+	}
+	printf ("Ring of %d slots, at most %lu full\n", RING_SLOTS,
+		(unsigned long) ring.highwater);
+	printf ("Readers waited for the ring %.3f s\n", stalled / 1e9);
+}
+
+/* Queue a changed file for its reader thread. */
+
+void
+queue_file (file_t *f)
+{
+	worker_t *w;
+
+	/* Nothing to read. */
+	if (f->offset == f->endpos)
+	{
+		return;
+	}
+
+	/* Opened by the main thread, which keeps the budget. */
+	if (open_file (f) == -1)
+	{
+		fprintf (stderr, "Error opening %s\n", f->name);
+		perror ("Error context");
+		error ("Cannot open file to print changes");
+	}
+	w = &workers[hash_inode (f->dev, f->ino) % (unsigned long) nworkers];
+	w->jobs[w->njobs++] = f->sn;
+	f->queued = true;
+	nqueued++;
+}
+
+/* Let the reader threads read the files queued, sending the lines as
+   they arrive in the ring until all the threads are done. */
+
+void
+run_round (void)
+{
+	slot_t *slot;
+	int done;
+	int spins;
+	int i;
+	int j;
+
+	/* Start the round. */
+	(void) pthread_mutex_lock (&poolmutex);
+	atomic_store_explicit (&nfinished, 0, memory_order_relaxed);
+	rounds++;
+	(void) pthread_cond_broadcast (&poolstart);
+	(void) pthread_mutex_unlock (&poolmutex);
+
+	/* Send. The ring is checked once more after all are done. */
+	spins = 0;
+	while (true)
+	{
+		done = (atomic_load_explicit (&nfinished, memory_order_acquire) ==
+			nworkers);
+		slot = get_ring ();
+		if (slot != NULL)
+		{
+			emit_collected (slot->data, slot->used);
+			release_ring (slot);
+			spins = 0;
+		}
+		else if (done)
+		{
+			break;
+		}
+		else
+		{
+			ring_pause (spins++);
+		}
+	}
+	for (i=0; i<nworkers; i++)
+	{
+		for (j=0; j<workers[i].njobs; j++)
+		{
+			files[workers[i].jobs[j]].queued = false;
+		}
+		workers[i].njobs = 0;
+	}
+	nqueued = 0;
+}
+
+/* Whether the file matched the pattern and not the exclude pattern.
+   The state is where the name took the matcher. */
+
+int
+selected (int state, int patternid, int excludeid, char *filename)
+{
+	if (! matched (state, patternid))
+	{
+		return (false);
+	}
+	if (excludeid != -1 && matched (state, excludeid))
+	{
+		if (verbose)
+		{
+			printf ("Excluded %s with %s\n", filename, patterns[excludeid]);
+		}
+		return (false);
+	}
+	if (verbose)
+	{
+		if (excludeid != -1)
+		{
+			printf ("Matched %s with %s\n", filename, patterns[patternid]);
+		}
+		else
+		{
+			printf ("Matched %s with %s no exclude\n", filename,
+				patterns[patternid]);
+		}
+	}
+	return (true);
+}
+
+/* Insert file into the global file table if it matched, see above. */
+
+void
+insert_matched (int state, int patternid, int excludeid, char *filename)
+{
+	if (selected (state, patternid, excludeid, filename))
+	{
+		put_file (filename);
+	}
+}
+
+/* Whether the file matches the pattern and not the exclude pattern. */
+
+int
+wanted (char *pattern, char *exclude, char *filename)
+{
+	int patternid;
+	int excludeid;
+
+	if ((pattern == NULL) || (exclude == NULL))
+	{
+		printf ("Excluded %s on null pattern\n", filename);
+		return (false);
+	}
+	patternid = pattern_id (pattern);
+	excludeid = (*exclude == EOS) ? -1 : pattern_id (exclude);
+	return (selected (match_all (filename), patternid, excludeid, filename));
+}
+
+/* Insert matching file into the global file table. */
+
+void
+insert_matching (char *pattern, char *exclude, char *filename)
+{
+	if (wanted (pattern, exclude, filename))
+	{
+		put_file (filename);
+	}
+}
+
+/* Whether names in the directory or under it can match the pattern.
+   Subtrees outside the literal parts of the pattern, or deeper than it
+   allows, are skipped without being opened. */
+
+int
+may_match (char *pattern, char *path)
+{
+	char prefix[PATH_MAX+2];
+	int id;
+
+	if (pattern == NULL)
+	{
+		return (true);
+	}
+
+	id = pattern_id (pattern);
+	(void) snprintf (prefix, sizeof (prefix), "%s/", path);
+	return (pattern_alive (match_all (prefix), id));
+}
+
+/* Directories on the way down a scan, to notice symbolic link loops,
+   and the device the scan started on. */
+typedef struct ancestor
+{
+	dev_t dev;
+	ino_t ino;
+	dev_t root;
+	struct ancestor *up;
+} ancestor_t;
+
+/* Directory left to a scanning thread, with its own copy of the
+   directories above it. */
+typedef struct scanjob
+{
+	char *path;
+	char *pattern;
+	char *exclude;
+	ancestor_t *up;
+} scanjob_t;
+
+/* Directory or file found by a scan. The tables are only changed once
+   the scan is over, from what the threads found. */
+typedef struct found
+{
+	char *path;
+	char *pattern;
+	char *exclude;
+	int isdir;
+	int wd;
+	struct timespec mtime;
+	filestat_t fs;
+} found_t;
+
+/* Scanning thread. A thread takes its own jobs from the end, the ones
+   it left last, and steals the oldest ones of the others, the biggest
+   subtrees as a rule. */
+typedef struct scanner
+{
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	scanjob_t *jobs;
+	int first;
+	int last;
+	int jobssize;
+	found_t *found;
+	int nfound;
+	int foundsize;
+} scanner_t;
+
+/* Most threads scanning at startup. */
+#define SCANNERS_MAX 8
+
+/* The scanning threads, the first one is the calling thread. */
+scanner_t *scanners = NULL;
+int nscanners = 0;
+
+/* Roots queued so far, spread over the threads. */
+int nroots = 0;
+
+/* A root that cannot be opened is fatal, at startup only. */
+int scanfatal = false;
+
+/* Jobs queued or being run, and threads out of work. */
+atomic_int scanpending;
+atomic_int scanidle;
+
+/* The matcher builds its states lazily, one thread at a time. */
+pthread_mutex_t matchmutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Copy the directories above a job handed to another thread. */
+
+ancestor_t *
+copy_ancestors (ancestor_t *a)
+{
+	ancestor_t *copy;
+	ancestor_t **tail;
+
+	copy = NULL;
+	tail = &copy;
+	for (; a!=NULL; a=a->up)
+	{
+		*tail = new (ancestor_t);
+		**tail = *a;
+		tail = &(*tail)->up;
+	}
+	*tail = NULL;
+	return (copy);
+}
+
+/* Free the copy. */
+
+void
+free_ancestors (ancestor_t *a)
+{
+	ancestor_t *up;
+
+	for (; a!=NULL; a=up)
+	{
+		up = a->up;
+		free (a);
+	}
+}
+
+/* Queue a directory for the scanning thread. */
+
+void
+push_job (scanner_t *s, char *path, char *pattern, char *exclude,
+	ancestor_t *up)
+{
+	(void) atomic_fetch_add (&scanpending, 1);
+	(void) pthread_mutex_lock (&s->mutex);
+	if (s->first == s->last)
+	{
+		s->first = 0;
+		s->last = 0;
+	}
+	if (s->last == s->jobssize)
+	{
+		if (s->first > 0)
+		{
+			(void) memmove (s->jobs, s->jobs + s->first,
+				(size_t) (s->last - s->first) * sizeof (scanjob_t));
+			s->last -= s->first;
+			s->first = 0;
+		}
+		else
+		{
+			s->jobssize = (s->jobssize == 0) ? 64 : s->jobssize * 2;
+			s->jobs = (scanjob_t *) reallocate (s->jobs,
+				s->jobssize * sizeof (scanjob_t));
+		}
+	}
+	s->jobs[s->last].path = strdup (path);
+	s->jobs[s->last].pattern = pattern;
+	s->jobs[s->last].exclude = exclude;
+	s->jobs[s->last].up = up;
+	s->last++;
+	(void) pthread_mutex_unlock (&s->mutex);
+}
+
+/* Take a job, an own one or one of another thread. */
+
+int
+take_job (scanner_t *s, scanjob_t *job)
+{
+	scanner_t *v;
+	int taken;
+	int i;
+
+	(void) pthread_mutex_lock (&s->mutex);
+	taken = (s->last > s->first);
+	if (taken)
+	{
+		*job = s->jobs[--s->last];
+	}
+	(void) pthread_mutex_unlock (&s->mutex);
+	for (i=1; i<nscanners && ! taken; i++)
+	{
+		v = &scanners[(s - scanners + i) % nscanners];
+		(void) pthread_mutex_lock (&v->mutex);
+		taken = (v->last > v->first);
+		if (taken)
+		{
+			*job = v->jobs[v->first++];
+		}
+		(void) pthread_mutex_unlock (&v->mutex);
+	}
+	return (taken);
+}
+
+/* Note a directory or file found. */
+
+found_t *
+add_found (scanner_t *s, char *path, char *pattern, char *exclude, int isdir)
+{
+	found_t *found;
+
+	if (s->nfound == s->foundsize)
+	{
+		s->foundsize = (s->foundsize == 0) ? 1024 : s->foundsize * 2;
+		s->found = (found_t *) reallocate (s->found,
+			s->foundsize * sizeof (found_t));
+	}
+	found = &s->found[s->nfound++];
+	found->path = strdup (path);
+	found->pattern = pattern;
+	found->exclude = exclude;
+	found->isdir = isdir;
+	return (found);
+}
+
+/* Scan directory tree. The path holds the directory name, length long,
+   the names of the entries are put after it. The directory is opened by
+   its name relative to the parent and the type of the entries is taken
+   from the directory where the file system gives it. Subdirectories go
+   to the other threads while some are out of work, otherwise they are
+   scanned here. */
+
+void
+scan_dir (scanner_t *s, char *pattern, char *exclude, char *path,
+	size_t length, int parentfd, char *name, ancestor_t *up)
+{
+	ancestor_t self;
+	ancestor_t *a;
+	struct stat st;
+	struct dirent *e;
+	found_t *found;
+	filestat_t fs;
+	DIR *d;
+	size_t namelength;
+	int isdir;
+	int take;
+	int fd;
+
+	/* Open directory. */
+	fd = openat (parentfd, name, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+	if (fd == -1 || fstat (fd, &st) == -1)
+	{
+		(void) fprintf (stderr, "Error opening directory %s\n", path);
+		if (up == NULL && scanfatal)
+		{
+			error ("Cannot open directory");
+		}
+		perror ("Error context");
+		if (fd != -1)
+		{
+			(void) close (fd);
+		}
+		return;
+	}
+
+	/* Reached through a symbolic link to a directory above. */
+	for (a=up; a!=NULL; a=a->up)
+	{
+		if (a->dev == st.st_dev && a->ino == st.st_ino)
+		{
+			if (verbose)
+			{
+				printf ("Loop at %s\n", path);
+			}
+			(void) close (fd);
+			return;
+		}
+	}
+
+	/* On another file system. */
+	if (samefs && up != NULL && st.st_dev != up->root)
+	{
+		if (verbose)
+		{
+			printf ("Other file system at %s\n", path);
+		}
+		(void) close (fd);
+		return;
+	}
+	self.dev = st.st_dev;
+	self.ino = st.st_ino;
+	self.root = (up == NULL) ? st.st_dev : up->root;
+	self.up = up;
+
+	/* Remember the directory for rescanning, watched before it is read
+	   so that no change goes unnoticed. */
+	found = add_found (s, path, pattern, exclude, true);
+	found->wd = watch_path (path);
+	found->mtime = st.st_mtim;
+
+	/* Read directory entries. */
+	d = fdopendir (fd);
+	if (d == NULL)
+	{
+		perror ("Error context");
+		error ("Cannot read directory");
+	}
+	errno = 0;
+	while ((e = readdir (d)) != NULL)
+	{
+		if (eqs (e->d_name, ".") || eqs (e->d_name, ".."))
+		{
+			continue;
+		}
+		namelength = strlen (e->d_name);
+		if (length + 1 + namelength > PATH_MAX)
+		{
+			(void) fprintf (stderr, "Name too long in %s\n", path);
+			continue;
+		}
+		path[length] = '/';
+		(void) memcpy (path + length + 1, e->d_name, namelength + 1);
+
+		/* The status is only needed when the file system does not tell
+		   the type or for a symbolic link, which is followed. */
+		if (e->d_type == DT_UNKNOWN || e->d_type == DT_LNK)
+		{
+			isdir = (fstatat (fd, e->d_name, &st, 0) == 0) &&
+				S_ISDIR (st.st_mode);
+		}
+		else
+		{
+			isdir = (e->d_type == DT_DIR);
+		}
+
+		/* Match the name. */
+		(void) pthread_mutex_lock (&matchmutex);
+		take = isdir ? may_match (pattern, path) :
+			wanted (pattern, exclude, path);
+		(void) pthread_mutex_unlock (&matchmutex);
+
+		/* Descend if it is a directory, otherwise note the file with its
+		   status, the file may be gone already. */
+		if (! isdir)
+		{
+			if (take && stat_file_at (fd, e->d_name, &fs) == 0)
+			{
+				add_found (s, path, pattern, exclude, false)->fs = fs;
+			}
+		}
+		else if (! take)
+		{
+			if (verbose)
+			{
+				printf ("Pruned %s\n", path);
+			}
+		}
+		else if (atomic_load_explicit (&scanidle, memory_order_relaxed) > 0)
+		{
+			push_job (s, path, pattern, exclude, copy_ancestors (&self));
+		}
+		else
+		{
+			scan_dir (s, pattern, exclude, path, length + 1 + namelength, fd,
+				e->d_name, &self);
+		}
+		errno = 0;
+	}
+	if (errno != 0)
+	{
+		(void) fprintf (stderr, "Error scanning directory %s\n", path);
+	}
+	path[length] = EOS;
+
+	/* List exhausted, finish. */
+	if (closedir (d) != 0)
+	{
+		error ("Error closing directory");
+	}
+}
+
+/* Scanning thread, runs the jobs until there are none left anywhere. */
+
+void *
+run_scanner (void *arg)
+{
+	scanner_t *s;
+	scanjob_t job;
+	char path[PATH_MAX+1];
+	int idle;
+	int spins;
+
+	s = (scanner_t *) arg;
+	idle = false;
+	spins = 0;
+	while (true)
+	{
+		if (take_job (s, &job))
+		{
+			if (idle)
+			{
+				(void) atomic_fetch_sub (&scanidle, 1);
+				idle = false;
+			}
+			path[PATH_MAX] = EOS;
+			(void) strncpy (path, job.path, PATH_MAX);
+			scan_dir (s, job.pattern, job.exclude, path, strlen (path),
+				AT_FDCWD, path, job.up);
+			free (job.path);
+			free_ancestors (job.up);
+			(void) atomic_fetch_sub (&scanpending, 1);
+			spins = 0;
+		}
+		else if (atomic_load (&scanpending) == 0)
+		{
+			break;
+		}
+		else
+		{
+			if (! idle)
+			{
+				(void) atomic_fetch_add (&scanidle, 1);
+				idle = true;
+			}
+			ring_pause (spins++);
+		}
+	}
+	if (idle)
+	{
+		(void) atomic_fetch_sub (&scanidle, 1);
+	}
+	return (NULL);
+}
+
+/* Prepare a scan with the number of threads given, whether a root
+   that cannot be opened is fatal. */
+
+void
+init_scan (int count, int fatal)
+{
+	int i;
+
+	nscanners = count;
+	scanfatal = fatal;
+	nroots = 0;
+	scanners = (scanner_t *) allocate (count * sizeof (scanner_t));
+	(void) memset (scanners, 0, count * sizeof (scanner_t));
+	for (i=0; i<count; i++)
+	{
+		(void) pthread_mutex_init (&scanners[i].mutex, NULL);
+	}
+	atomic_init (&scanpending, 0);
+	atomic_init (&scanidle, 0);
+}
+
+/* Queue directory tree to scan. */
+
+void
+queue_scan (char *pattern, char *exclude, char *path)
+{
+	push_job (&scanners[nroots++ % nscanners], path, pattern, exclude, NULL);
+}
+
+/* Walk the queued trees. The calling thread takes part, the others are
+   started for the walk and do not take signals. */
+
+void
+walk_scan (void)
+{
+	sigset_t all;
+	sigset_t old;
+	int i;
+
+	(void) sigfillset (&all);
+	(void) pthread_sigmask (SIG_SETMASK, &all, &old);
+	for (i=1; i<nscanners; i++)
+	{
+		if (pthread_create (&scanners[i].thread, NULL, run_scanner,
+			&scanners[i]) != 0)
+		{
+			error ("Cannot create scanning thread");
+		}
+	}
+	(void) pthread_sigmask (SIG_SETMASK, &old, NULL);
+	(void) run_scanner (&scanners[0]);
+	for (i=1; i<nscanners; i++)
+	{
+		(void) pthread_join (scanners[i].thread, NULL);
+	}
+}
+
+/* Register what the scan found, the directories first so that their
+   files know whether they are watched, and finish the scan. */
+
+void
+register_scan (void)
+{
+	scanner_t *s;
+	found_t *found;
+	int n;
+	int i;
+	int j;
 
-	if (f != NULL)
+	for (i=0; i<nscanners; i++)
+	{
+		s = &scanners[i];
+		for (j=0; j<s->nfound; j++)
+		{
+			found = &s->found[j];
+			if (found->isdir)
+			{
+				n = get_dir (found->path);
+				if (n == -1)
+				{
+					n = new_dir (found->path, found->wd, &found->mtime);
+				}
+				add_filter (n, found->pattern, found->exclude, NULL);
+			}
+		}
+	}
+	for (i=0; i<nscanners; i++)
 	{
+		s = &scanners[i];
+		for (j=0; j<s->nfound; j++)
+		{
+			found = &s->found[j];
+			if (! found->isdir && get_file (found->path) == NULL)
+			{
+				add_file (found->path, &found->fs);
+			}
+			free (found->path);
+		}
+		free (s->found);
+		free (s->jobs);
+		(void) pthread_mutex_destroy (&s->mutex);
+	}
+	free (scanners);
+	scanners = NULL;
+	nscanners = 0;
+}
 
-		/* Mark it as removed. */
-		f->sn = -1;
+/* Scan directory tree in the calling thread, one found after startup.
+   A tree that cannot be opened by then is skipped. */
 
-		/* Free allocated objects. */
-		if (f->name != NULL)
+void
+scan (char *pattern, char *exclude, char *path)
+{
+	init_scan (1, false);
+	queue_scan (pattern, exclude, path);
+	walk_scan ();
+	register_scan ();
+}
+
+/* Queue directory tree for the scan or insert single file. */
+
+void
+put_entry (char *pattern, char *exclude, char *name)
+{
+	char dircopy[PATH_MAX+1];
+
+	if (directory (name))
+	{
+		if (verbose)
+		{
+			printf ("Scanning %s\n", name);
+		}
+		queue_scan (pattern, exclude, name);
+	}
+	else
+	{
+
+		/* Remember the directory to notice when the file is recreated. */
+		dircopy[PATH_MAX] = EOS;
+		(void) strncpy (dircopy, name, PATH_MAX);
+		(void) put_dir (dirname (dircopy), pattern, exclude, name);
+		insert_matching (pattern, exclude, name);
+	}
+}
+
+/* Rescan one directory. New files are registered and new subdirectories
+   scanned, removed files are noticed when they are checked. */
+
+void
+rescan_dir (int n)
+{
+	DIR *d;
+	struct dirent *e;
+	struct stat st;
+	char filename[PATH_MAX+1];
+	filter_t *filter;
+	size_t length;
+	size_t namelength;
+	int isdir;
+	int sub;
+	int state;
+	int status;
+
+	if (verbose)
+	{
+		printf ("Rescanning %s\n", dirs[n].name);
+	}
+	dirs[n].dirty = false;
+
+	/* Take the modification time before reading to not miss changes. */
+	status = stat (dirs[n].name, &st);
+	if (status == -1)
+	{
+		remove_dir (n);
+		return;
+	}
+	dirs[n].mtime = st.st_mtim;
+
+	/* Open directory. */
+	d = opendir (dirs[n].name);
+	if (d == NULL)
+	{
+		remove_dir (n);
+		return;
+	}
+
+	/* Entry names are put after the directory name. */
+	length = strlen (dirs[n].name);
+	(void) memcpy (filename, dirs[n].name, length);
+	filename[length] = '/';
+
+	/* Read directory entries. */
+	errno = 0;
+	while ((e = readdir (d)) != NULL)
+	{
+		if (eqs (e->d_name, ".") || eqs (e->d_name, ".."))
 		{
-			free (f->name);
-			f->name = NULL;
+			continue;
 		}
-		if (f->fd != -1)
+		namelength = strlen (e->d_name);
+		if (length + 1 + namelength > PATH_MAX)
 		{
-			(void) close (f->fd);
-			f->fd = -1;
+			continue;
 		}
-		if (f->statbuf != NULL)
+		(void) memcpy (filename + length + 1, e->d_name, namelength + 1);
+
+		/* Type from the entry, the status is only needed when the file
+		   system does not tell or for a symbolic link. The entry may
+		   be gone already. */
+		if (e->d_type == DT_UNKNOWN || e->d_type == DT_LNK)
 		{
-			free (f->statbuf);
-			f->statbuf = NULL;
+			if (fstatat (dirfd (d), e->d_name, &st, 0) == -1)
+			{
+				continue;
+			}
+			isdir = S_ISDIR (st.st_mode);
 		}
-		if (f->laststatbuf != NULL)
+		else
 		{
-			free (f->laststatbuf);
-			f->laststatbuf = NULL;
+			isdir = (e->d_type == DT_DIR);
 		}
 
-		/* Initialize. */
-		f->lastmodified = (time_t) 0;
-		f->modified = (time_t) 0;
-		f->lastendpos = (off_t) 0;
-		f->endpos = (off_t) 0;
+		/* Apply the filters, the name is matched against all the
+		   patterns at once. The table may grow under us. */
+		state = isdir ? -1 : match_all (filename);
+		for (filter=dirs[n].filters; filter!=NULL; filter=filter->next)
+		{
+			if (isdir)
+			{
+				if (filter->file == NULL)
+				{
+					sub = get_dir (filename);
+					if ((sub == -1 ||
+						! has_filter (sub, filter->pattern,
+						filter->exclude, NULL)) &&
+						may_match (filter->pattern, filename))
+					{
+						scan (filter->pattern, filter->exclude, filename);
+					}
+				}
+			}
+			else if (filter->file == NULL || eqs (filter->file, filename))
+			{
+				insert_matched (state, filter->patternid, filter->excludeid,
+					filename);
+			}
+		}
+		errno = 0;
+	}
+	if (errno != 0)
+	{
+		fprintf (stderr, "Error scanning directory %s\n", dirs[n].name);
+	}
+
+	/* List exhausted, finish. */
+	status = closedir (d);
+	if (status != 0)
+	{
+		error ("Error closing directory");
 	}
-	nfiles--;
 }
 
-/* Check if file changed. */
+/* Update the file table from the directories that changed. When polling
+   the directories without change notification are checked as well.
+   Return whether there are any such directories. */
 
 int
-check_file (file_t *f)
+update_table (int polling)
 {
-	int fd;
-	off_t filepos;
+	int i;
+	int n;
 	int status;
+	unsigned long start;
+	struct stat st;
+
+	for (i=0; i<ndirs && polling && npolleddirs > 0; i++)
+	{
+		if (dirs[i].name == NULL || ! dirs[i].polled)
+		{
+			continue;
+		}
+		status = stat (dirs[i].name, &st);
+		if (status == -1)
+		{
+			remove_dir (i);
+			continue;
+		}
+		if (st.st_mtim.tv_sec != dirs[i].mtime.tv_sec ||
+			st.st_mtim.tv_nsec != dirs[i].mtime.tv_nsec)
+		{
+			mark_dirty (i);
+		}
+	}
+
+	/* Read the directories on the list, including those put on it
+	   meanwhile. One removed while on it is passed over. */
+	while (dirtydirs != -1)
+	{
+		n = dirtydirs;
+		dirtydirs = dirs[n].nextdirty;
+		if (dirs[n].name == NULL)
+		{
+			dirs[n].dirty = false;
+			continue;
+		}
+		start = now_ns ();
+		rescan_dir (n);
+		add_count (&counters[0].rescans, 1UL);
+		add_count (&counters[0].rescantime, now_ns () - start);
+	}
+	return (npolleddirs > 0);
+}
+
+/* Schedule the next poll of a file without change notification, soon
+   after a change, later and later while it stays unchanged. */
+
+void
+schedule_poll (file_t *f, int changed, unsigned long now)
+{
+	unsigned long most;
+
+	most = (unsigned long) delayseconds * 1000UL;
+	if (changed)
+	{
+		f->active = now;
+		f->interval = POLL_HOT;
+	}
+	else if (now - f->active >= HOT_SPAN)
+	{
+		if (now - f->active >= most * COLD_FACTOR)
+		{
+			most *= COLD_FACTOR;
+		}
+		f->interval = (f->interval * 2 > most) ? most : f->interval * 2;
+	}
+	f->due = now + f->interval;
+}
+
+/* Earliest time a file without change notification is due to poll,
+   milliseconds on the monotonic clock. */
+unsigned long nextpoll = ULONG_MAX;
+
+/* Drops not reported yet, some file has them. */
+int dropsheld = false;
+
+/* Check file catalog, the files changed and the files without change
+   notification due to poll by the time given. Only these are looked at,
+   the rest of the catalog is not walked. */
+
+void
+check_catalog (reader_t *r, unsigned long now)
+{
+	int i;
+	int n;
+	int done;
+	int changed;
+	file_t *f;
+
+	/* Drops are reported at most once per delay. */
+	if (dropsheld && time (NULL) >= droptime)
+	{
+		droptime = time (NULL) + delayseconds;
+		for (i=0; i<nslots; i++)
+		{
+			if (files[i].sn != -1 && extra (&files[i])->dropped > 0)
+			{
+				report_dropped (&files[i]);
+			}
+		}
+		dropsheld = false;
+	}
+	r->ndeferred = 0;
+	for (i=0; i<nworkers && workers != NULL; i++)
+	{
+		workers[i].reader.ndeferred = 0;
+	}
+	sinkwait = SINK_WAIT;
+
+	/* The files due to poll join those to check. */
+	while (npolls > 0 && files[polls[0]].due <= now)
+	{
+		n = polls[0];
+		remove_poll (n);
+		mark_pending (n);
+	}
+
+	/* Take the files to check in the order they were marked. They are
+	   kept on a list of their own until read, so as not to be put on
+	   the list again meanwhile. While the target is busy the rest stay
+	   on the list for when it takes more. */
+	done = -1;
+	while (pendinghead != -1)
+	{
+		if (workers == NULL &&
+			atomic_load_explicit (&sinkbusy, memory_order_relaxed))
+		{
+			r->ndeferred++;
+			break;
+		}
+		n = pendinghead;
+		f = &files[n];
+		pendinghead = f->nextpending;
+		if (pendinghead == -1)
+		{
+			pendingtail = -1;
+		}
+		f->nextpending = done;
+		done = n;
+		if (f->sn == -1)
+		{
+			continue;
+		}
+		f->changed = false;
+		changed = check_file (r, f);
+		if (f->sn != -1 && ! f->watched)
+		{
+			remove_poll (n);
+			schedule_poll (f, changed, now);
+			push_poll (n);
+		}
+		if (changed || (f->sn != -1 && f->throttled))
+		{
+			if (verbose)
+			{
+				printf ("Changed %s\n", f->name);
+			}
+			progress = true;
+			if (workers == NULL)
+			{
+				print_file_change (r, f, false);
+			}
+			else
+			{
+				while (nqueued >= openfiles)
+				{
+					run_round ();
+				}
+				queue_file (f);
+			}
+		}
+	}
+	/* Read what is queued for the reader threads. */
+	while (nqueued > 0)
+	{
+		run_round ();
+	}
+
+	/* Files held back are checked again shortly, as are those marked
+	   changed while they were on the list. */
+	while (done != -1)
+	{
+		f = &files[done];
+		done = f->nextpending;
+		f->pending = false;
+		if (f->sn == -1)
+		{
+			continue;
+		}
+		if (f->changed || f->throttled)
+		{
+			mark_pending (f->sn);
+		}
+		dropsheld = dropsheld || (extra (f)->dropped > 0);
+	}
+	throttled = (r->ndeferred > 0);
+	for (i=0; i<nworkers && workers != NULL; i++)
+	{
+		throttled = throttled || (workers[i].reader.ndeferred > 0);
+	}
+	nextpoll = (npolls > 0) ? files[polls[0]].due : ULONG_MAX;
+
+	/* Send what is left in the batch. */
+	if (sinktype != SINK_SYSLOG)
+	{
+		flush_sink ();
+	}
+}
+
+/* Control socket in the log directory. A client connects, writes a
+   command on a line and reads the answer until the connection is
+   closed. The answer is put together at once between the checks and
+   written as the client takes it, forwarding does not wait for it. */
+#define CONTROL_NAME "logforw.sock"
+
+/* Clients served at a time, and the time one may take, in seconds. */
+#define CLIENTS_MAX 8
+#define CLIENT_TIMEOUT 10
+
+/* Longest command. */
+#define COMMAND_MAX 64
+
+/* Text put together in a buffer kept for reuse. */
+typedef struct
+{
+	char *buffer;
+	size_t size;
+	size_t used;
+} text_t;
+
+/* Client of the control socket. */
+typedef struct
+{
+
+	/* Connection, -1 if the entry is free, and the time it was made. */
+	int fd;
+	time_t since;
+
+	/* Command read so far. */
+	char command[COMMAND_MAX];
+	int length;
+
+	/* Answer and how much of it was written, the buffer is kept for
+	   the next client. */
+	text_t answer;
+	size_t done;
+} client_t;
+
+/* Clients. */
+client_t clients[CLIENTS_MAX];
+
+/* Listening socket, -1 if none. */
+int controlfd = -1;
+
+/* Time started. */
+time_t starttime;
+
+/* Open the control socket. One left behind by a daemon no longer
+   running is replaced, one still answering is left alone. Forwarding
+   goes on without it if it cannot be opened. */
+
+void
+open_control (void)
+{
+	struct sockaddr_un addr;
+	char path[PATH_MAX+1];
+	int probe;
+	int i;
+
+	starttime = time (NULL);
+	for (i=0; i<CLIENTS_MAX; i++)
+	{
+		clients[i].fd = -1;
+	}
+	state_path (path, CONTROL_NAME);
+	if (strlen (path) >= sizeof (addr.sun_path))
+	{
+		(void) fprintf (stderr, "Control socket path %s too long\n", path);
+		return;
+	}
+	(void) memset (&addr, 0, sizeof (addr));
+	addr.sun_family = AF_UNIX;
+	(void) strcpy (addr.sun_path, path);
+	controlfd = socket (AF_UNIX, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
+	if (controlfd == -1)
+	{
+		perror ("Error context");
+		(void) fprintf (stderr, "Cannot open control socket %s\n", path);
+		return;
+	}
+	if (bind (controlfd, (struct sockaddr *) &addr, sizeof (addr)) == -1 &&
+		errno == EADDRINUSE)
+	{
+		probe = socket (AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+		if (probe != -1 &&
+			connect (probe, (struct sockaddr *) &addr, sizeof (addr)) == 0)
+		{
+			(void) close (probe);
+			(void) close (controlfd);
+			controlfd = -1;
+			(void) fprintf (stderr, "Control socket %s in use\n", path);
+			return;
+		}
+		if (probe != -1)
+		{
+			(void) close (probe);
+		}
+		(void) unlink (path);
+		(void) bind (controlfd, (struct sockaddr *) &addr, sizeof (addr));
+	}
+	if (chmod (path, (mode_t) 0600) == -1 ||
+		listen (controlfd, CLIENTS_MAX) == -1)
+	{
+		perror ("Error context");
+		(void) fprintf (stderr, "Cannot open control socket %s\n", path);
+		(void) close (controlfd);
+		controlfd = -1;
+		return;
+	}
+	watch_fd (controlfd, EPOLLIN);
+	if (verbose)
+	{
+		printf ("Control socket %s\n", path);
+	}
+}
+
+/* Remove the control socket. */
+
+void
+close_control (void)
+{
+	char path[PATH_MAX+1];
+
+	if (controlfd != -1)
+	{
+		(void) close (controlfd);
+		controlfd = -1;
+		state_path (path, CONTROL_NAME);
+		(void) unlink (path);
+	}
+}
+
+/* Close the connection of a client and free its entry. */
+
+void
+close_client (client_t *c)
+{
+	(void) close (c->fd);
+	c->fd = -1;
+	c->length = 0;
+	c->answer.used = 0;
+	c->done = 0;
+}
+
+/* Add to a text. */
+
+void
+add_text (text_t *t, char *format, ...)
+{
+	va_list ap;
+	int n;
+
+	va_start (ap, format);
+	n = vsnprintf (NULL, 0, format, ap);
+	va_end (ap);
+	(void) reserve (&t->buffer, &t->size, t->used + (size_t) n + 1);
+	va_start (ap, format);
+	(void) vsnprintf (t->buffer + t->used, (size_t) n + 1, format, ap);
+	va_end (ap);
+	t->used += (size_t) n;
+}
+
+/* Answer the status: a line with the totals, then a line for each file
+   in the catalog, as names and values. The file name comes last since
+   it may hold blanks. */
+
+void
+answer_status (text_t *t)
+{
+	file_t *f;
+	fileextra_t *x;
+	unsigned long lines;
+	unsigned long bytes;
+	unsigned long drops;
+	off_t lag;
+	int known;
+	int watched;
+	int i;
 
-	/* Open file. */
-	fd = open (f->name, O_RDONLY);
-	if (fd == -1)
+	lines = pastlines;
+	bytes = pastbytes;
+	drops = pastdrops;
+	lag = (off_t) 0;
+	for (i=0; i<nslots; i++)
 	{
-		if (fd = ENOENT)
+		f = &files[i];
+		x = extra (f);
+		if (f->sn != -1)
 		{
-
-			/* The file was removed in the meantime and the entry should
-			   be removed as well. */
-			if (verbose)
-			{
-				printf ("Deregister %s\n", f->name);
-			}
-			remove_entry (f->sn);
-
-			/* Quit here prematurely, there is nothing more to do. */
-			return (false);
+			lines += x->lines;
+			bytes += x->bytes;
+			drops += x->drops;
+			lag += f->endpos - f->offset;
 		}
-
-		/* Just some other error. */
-		fprintf (stderr, "Error opening %s\n", f->name);
-		perror ("Error context");
-		error ("Cannot open file");
 	}
-	f->fd = fd;
-
-	/* Save old status block and get a new one. */
-	(void) memcpy (f->laststatbuf, f->statbuf, sizeof (struct stat));
-	status = fstat (fd, f->statbuf);
-	if (status == -1)
+	known = 0;
+	watched = 0;
+	for (i=0; i<ndirs; i++)
 	{
-		fprintf (stderr, "Error calling stat for %s\n", f->name);
-		perror ("Error context");
-		error ("Cannot stat file");
+		if (dirs[i].name != NULL)
+		{
+			known++;
+			watched += (dirs[i].wd != -1);
+		}
 	}
-
-	/* Save old modified time and get current. */
-	f->lastmodified = f->modified;
-	f->modified = f->statbuf->st_mtime;
-
-	/* Get last and current end of file offset. */
-	filepos = lseek (fd, (off_t) 0, SEEK_END);
-	if (filepos == (off_t) -1)
+	add_text (t, "logforw pid=%ld started=%ld files=%d open=%d dirs=%d "
+		"watched=%d lines=%lu bytes=%lu dropped=%lu lag=%lld sent=%lu "
+		"unsent=%lu spooled=%d allocations=%lu\n", (long) getpid (),
+		(long) starttime, nfiles, nopen, known, watched, lines,
+		bytes, drops, (long long) lag, sink.sent, sink.dropped,
+		spool_pending (), (unsigned long) nallocations);
+	for (i=0; i<nslots; i++)
 	{
-		error ("Cannot seek");
+		f = &files[i];
+		x = extra (f);
+		if (f->sn != -1)
+		{
+			add_text (t, "file offset=%lld size=%lld lag=%lld lines=%lu "
+				"bytes=%lu dropped=%lu changed=%ld watched=%d name=%s\n",
+				(long long) f->offset, (long long) f->endpos,
+				(long long) (f->endpos - f->offset), x->lines, x->bytes,
+				x->drops, (long) f->modified, f->watched, f->name);
+		}
 	}
-	f->lastendpos = f->endpos;
-	f->endpos = filepos;
+}
 
-	/* Close file. */
-	status = close (fd);
-	if (status == -1)
-	{
-		error ("Cannot close");
-	}
-	f->fd = -1;
+/* Add the help and type lines of a metric. */
 
-	/* Report if changed. */
-	return ((f->lastmodified != f->modified) || (f->lastendpos != f->endpos));
+void
+add_metric (text_t *t, char *name, char *type, char *help)
+{
+	add_text (t, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
 }
 
-/* Remove newline and non-printable characters from the buffer. */
+/* Add a file name as a label value, with backslash, double quote and
+   new line escaped. */
 
 void
-printable (long nbytes, char *buffer)
+add_label (text_t *t, char *name)
 {
-	char *p;
-	long c;
+	char *q;
+	size_t length;
 
-	p = buffer;
-	c = 0;
-	while (c < nbytes)
+	length = strlen (name);
+	q = reserve (&t->buffer, &t->size, t->used + 2 * length + 1) + t->used;
+	for (; *name!=EOS; name++)
 	{
-		if (*p == NL)
+		if (*name == '\\' || *name == '"' || *name == NL)
 		{
-			*p = NLPRINT;
+			*q++ = '\\';
 		}
-		if (! isprint (*p))
-		{
-			*p = NONPRINT;
-		}
-		p++;
-		c++;
+		*q++ = (*name == NL) ? 'n' : *name;
 	}
+	t->used = (size_t) (q - t->buffer);
 }
 
-/* Forward buffer content to syslog. */
+/* Add a metric of each file, a counter by its offset in the state used
+   less often or the lag. */
+#define FILE_LAG ((size_t) -1)
 
 void
-forward (char *name, long nbytes, char *buffer)
+add_file_metric (text_t *t, char *name, char *type, char *help,
+	size_t field)
 {
+	file_t *f;
+	unsigned long value;
 	int i;
-	char line[LINELENGTH_MAX+1];
-	char *from;
-	char *to;
-	unsigned long count;
-	char prefixname[PATH_MAX+1];
-	char *syslogprefix;
-	char syslogline[LINELENGTH_MAX+2+1];
-	unsigned long sysloglinelength;
 
-	/* Check. */
-	if (nbytes > LINELENGTH_MAX)
+	add_metric (t, name, type, help);
+	for (i=0; i<nslots; i++)
 	{
-
-		/* Line would be too long. */
-		fprintf (stderr, "File changed is %s\n", name);
-		fprintf (stderr, "Number of bytes to forward is %lu\n", nbytes);
-		fprintf (stderr, "First %d characters are shown\n", LONG_LINE);
-		fprintf (stderr, "Line would be too long\n");
-
-		/* Tried to show the beginning of the long line but not possible. */
-		if (LONG_LINE > LINELENGTH_MAX)
+		f = &files[i];
+		if (f->sn == -1)
+		{
+			continue;
+		}
+		if (field == FILE_LAG)
+		{
+			value = (unsigned long) (f->endpos - f->offset);
+		}
+		else
 		{
-			error ("Sample of long line to show is too long - confused");
+			value = *(unsigned long *) ((char *) extra (f) + field);
 		}
+		add_text (t, "%s{file=\"", name);
+		add_label (t, f->name);
+		add_text (t, "\"} %lu\n", value);
+	}
+}
 
-		/* Copy the beginning of the long line to show. */
-		(void) memcpy (line, buffer, (size_t) LONG_LINE);
+/* Put the metrics together in the Prometheus text format. */
 
-		/* Remove non-printable characters since these cases tend to
-		   be binary files included by mistake. */
-		printable (LONG_LINE, line);
-		line[LONG_LINE] = EOS;
+void
+add_metrics (text_t *t)
+{
+	unsigned long sends;
+	off_t lag;
+	int known;
+	int watched;
+	int i;
 
-		/* Show the line and quit. */
-		printf ("Buffer starts like '%s'\n", line);
-		return;
+	lag = (off_t) 0;
+	for (i=0; i<nslots; i++)
+	{
+		if (files[i].sn != -1)
+		{
+			lag += files[i].endpos - files[i].offset;
+		}
 	}
-
-	/* Looks fine, copy and forward line by line. */
-	from = buffer;
-	to = line;
-	*to = EOS;
-	count = 0;
-	for (i=0; i<nbytes; i++)
+	known = 0;
+	watched = 0;
+	for (i=0; i<ndirs; i++)
 	{
-
-		/* Paranoid check. */
-		if (count > (unsigned long) LINELENGTH_MAX)
+		if (dirs[i].name != NULL)
 		{
-			fprintf (stderr, "Line length is %lu\n", count);
-			error ("Line too long");
+			known++;
+			watched += (dirs[i].wd != -1);
 		}
+	}
 
-		/* Line terminated, forward. */
-		if (*from == NL)
+	/* Forwarding. */
+	add_metric (t, "logforw_lines_forwarded_total", "counter",
+		"Lines forwarded.");
+	add_text (t, "logforw_lines_forwarded_total %lu\n",
+		sum_counters (offsetof (counters_t, lines)));
+	add_metric (t, "logforw_bytes_forwarded_total", "counter",
+		"Bytes of the lines forwarded.");
+	add_text (t, "logforw_bytes_forwarded_total %lu\n",
+		sum_counters (offsetof (counters_t, bytes)));
+	add_metric (t, "logforw_lines_split_total", "counter",
+		"Pieces of lines too long forwarded apart.");
+	add_text (t, "logforw_lines_split_total %lu\n",
+		sum_counters (offsetof (counters_t, split)));
+	add_metric (t, "logforw_lines_dropped_total", "counter",
+		"Lines dropped lagging behind.");
+	add_text (t, "logforw_lines_dropped_total %lu\n",
+		sum_counters (offsetof (counters_t, dropped)));
+	add_metric (t, "logforw_lag_bytes", "gauge",
+		"Bytes written to the files and not forwarded yet.");
+	add_text (t, "logforw_lag_bytes %lld\n", (long long) lag);
+
+	/* Sending. */
+	add_metric (t, "logforw_messages_sent_total", "counter",
+		"Messages sent to the target.");
+	add_text (t, "logforw_messages_sent_total %lu\n", sink.sent);
+	add_metric (t, "logforw_messages_dropped_total", "counter",
+		"Messages the target did not take and could not be spooled.");
+	add_text (t, "logforw_messages_dropped_total %lu\n", sink.dropped);
+	add_metric (t, "logforw_spool_bytes", "gauge",
+		"Bytes waiting in the spool.");
+	add_text (t, "logforw_spool_bytes %llu\n", spool.map == NULL ? 0ULL :
+		(unsigned long long) (spool.head->write - spool.head->read));
+	add_metric (t, "logforw_send_seconds", "histogram",
+		"Time a send to the target or to syslog took.");
+	sends = 0;
+	for (i=0; i<=LATENCY_BUCKETS; i++)
+	{
+		sends += atomic_load_explicit (&counters[0].sends[i],
+			memory_order_relaxed);
+		if (i < LATENCY_BUCKETS)
 		{
-
-			/* Put end of string at the end. */
-			*to = EOS;
-
-			/* Forward the line. Prefix with file name. */
-			prefixname[PATH_MAX] = EOS;
-			(void) strncpy (prefixname, name, PATH_MAX);
-			syslogprefix = basename (prefixname);
-			sysloglinelength = strlen (syslogprefix) + strlen (line) + 2;
-			if (sysloglinelength > LINELENGTH_MAX)
-			{
-				fprintf (stderr, "Syslog line length is %lu\n", count);
-				error ("Line way too long");
-			}
-			syslogline[0] = EOS;
-			(void) strcat (syslogline, syslogprefix);
-			(void) strcat (syslogline, ": ");
-			(void) strcat (syslogline, line);
-			if (verbose)
-			{
-				printf ("%s\n", syslogline);
-			}
-			syslog (LOG_INFO, "%s", syslogline);
-
-			/* Back to beginning of line. */
-			to = line;
-			from++;
+			add_text (t, "logforw_send_seconds_bucket{le=\"%g\"} %lu\n",
+				(double) latencybounds[i] / 1e9, sends);
 		}
 		else
 		{
-
-			/* Just copy. */
-			*to = *from;
-			to++;
-			from++;
+			add_text (t, "logforw_send_seconds_bucket{le=\"+Inf\"} %lu\n",
+				sends);
 		}
-		count++;
 	}
+	add_text (t, "logforw_send_seconds_sum %.9f\n",
+		(double) atomic_load_explicit (&counters[0].sendtime,
+		memory_order_relaxed) / 1e9);
+	add_text (t, "logforw_send_seconds_count %lu\n", sends);
+
+	/* Scanning and the catalog. */
+	add_metric (t, "logforw_scan_seconds", "gauge",
+		"Time the scan at startup took.");
+	add_text (t, "logforw_scan_seconds %.9f\n", (double) scantime / 1e9);
+	add_metric (t, "logforw_rescans_total", "counter",
+		"Directories read again after a change.");
+	add_text (t, "logforw_rescans_total %lu\n",
+		sum_counters (offsetof (counters_t, rescans)));
+	add_metric (t, "logforw_rescan_seconds_total", "counter",
+		"Time spent reading directories again.");
+	add_text (t, "logforw_rescan_seconds_total %.9f\n",
+		(double) sum_counters (offsetof (counters_t, rescantime)) / 1e9);
+	add_metric (t, "logforw_files", "gauge", "Files in the catalog.");
+	add_text (t, "logforw_files %d\n", nfiles);
+	add_metric (t, "logforw_files_open", "gauge", "Files kept open.");
+	add_text (t, "logforw_files_open %d\n", nopen);
+	add_metric (t, "logforw_directories", "gauge",
+		"Directories holding the files.");
+	add_text (t, "logforw_directories %d\n", known);
+	add_metric (t, "logforw_directories_watched", "gauge",
+		"Directories with change notification.");
+	add_text (t, "logforw_directories_watched %d\n", watched);
+
+	/* Each file. */
+	add_file_metric (t, "logforw_file_lines_forwarded_total", "counter",
+		"Lines forwarded from the file.", offsetof (fileextra_t, lines));
+	add_file_metric (t, "logforw_file_bytes_forwarded_total", "counter",
+		"Bytes of the lines forwarded from the file.",
+		offsetof (fileextra_t, bytes));
+	add_file_metric (t, "logforw_file_lines_dropped_total", "counter",
+		"Lines dropped from the file lagging behind.",
+		offsetof (fileextra_t, drops));
+	add_file_metric (t, "logforw_file_lag_bytes", "gauge",
+		"Bytes written to the file and not forwarded yet.", FILE_LAG);
 }
 
-/* Print file additions. */
+/* Time between rewrites of the metrics file, seconds. */
+#define METRICS_INTERVAL 10
+
+/* Text of the metrics file, kept for reuse. */
+text_t metrics;
+
+/* Write the metrics file, to a temporary file renamed over it so the
+   readers see it whole. */
 
 void
-print_file_change (file_t *f)
+write_metrics (void)
 {
+	char temp[PATH_MAX+1];
+	ssize_t n;
 	int fd;
-	off_t offset;
-	char *buffer;
-	size_t buflen;
-	ssize_t nbytes;
-	int status;
 
-	/* Locate to last position. */
-	fd = open (f->name, O_RDONLY);
+	metrics.used = 0;
+	add_metrics (&metrics);
+	(void) snprintf (temp, sizeof (temp), "%s.tmp", metricsfile);
+	fd = open (temp, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0644);
 	if (fd == -1)
 	{
-		fprintf (stderr, "Error opening %s\n", f->name);
 		perror ("Error context");
-		error ("Cannot open file to print changes");
+		(void) fprintf (stderr, "Cannot write metrics file %s\n", temp);
+		return;
 	}
-	offset = lseek (fd, f->lastendpos, SEEK_SET);
-	if (offset == (off_t) -1)
+	n = write (fd, metrics.buffer, metrics.used);
+	if (close (fd) == -1 || n != (ssize_t) metrics.used ||
+		rename (temp, metricsfile) == -1)
 	{
-		fprintf (stderr, "Error positioning %s\n", f->name);
 		perror ("Error context");
-		error ("Cannot seek file to print changes");
+		(void) fprintf (stderr, "Cannot write metrics file %s\n",
+			metricsfile);
+		(void) unlink (temp);
 	}
+}
+
+/* Write what the client takes of the answer, the rest when it is ready
+   for more. The connection is closed once all is written. */
+
+void
+write_answer (client_t *c)
+{
+	ssize_t n;
 
-	/* Paranoid check. */
-	if (f->lastendpos > f->endpos)
+	while (c->done < c->answer.used)
 	{
-		fprintf (stderr, "Problem with %s\n", f->name);
-		fprintf (stderr, "Last position was %lu\n",
-			(unsigned long) f->lastendpos);
-		fprintf (stderr, "Current position is %lu\n",
-			(unsigned long) f->endpos);
-		fprintf (stderr, "File had contracted\n");
-		return;
+		n = send (c->fd, c->answer.buffer + c->done, c->answer.used - c->done,
+			MSG_DONTWAIT|MSG_NOSIGNAL);
+		if (n == -1)
+		{
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+			{
+				watch_fd (c->fd, EPOLLOUT);
+				return;
+			}
+			if (errno != EINTR)
+			{
+				break;
+			}
+			continue;
+		}
+		c->done += (size_t) n;
 	}
+	close_client (c);
+}
 
-	/* Number of bytes added. */
-	buflen = (size_t) (f->endpos - f->lastendpos);
+/* Run the command of a client. */
 
-	/* Nothing to print. */
-	if (buflen == (size_t) 0)
+void
+run_command (client_t *c)
+{
+	c->command[c->length] = EOS;
+	if (c->length > 0 && c->command[c->length - 1] == '\r')
 	{
-		return;
+		c->command[--c->length] = EOS;
 	}
-
-	/* Too much change. */
-	if (buflen >= BUFLEN_MAX)
+	if (c->length == 0 || eqs (c->command, "status"))
 	{
-		fprintf (stderr, "Problem with %s\n", f->name);
-		fprintf (stderr, "Last position was %lu\n",
-			(unsigned long) f->lastendpos);
-		fprintf (stderr, "Current position is %lu\n",
-			(unsigned long) f->endpos);
-		fprintf (stderr, "Large amounts of data added to the file\n");
-		return;
+		answer_status (&c->answer);
 	}
-
-	/* Read into the buffer. */
-	buffer = (char *) allocate (buflen);
-	(void) memset (buffer, 0, buflen);
-	nbytes = read (fd, buffer, buflen);
-	if (nbytes == (ssize_t) -1)
+	else if (eqs (c->command, "metrics"))
 	{
-		fprintf (stderr, "Error reading %s\n", f->name);
-		perror ("Error context");
-		error ("Cannot read from file to print changes");
+		add_metrics (&c->answer);
 	}
-	if (nbytes != (ssize_t) buflen)
+	else
 	{
-		fprintf (stderr, "Error reading %s - partial read\n", f->name);
-		perror ("Error context");
-		error ("Partial read from file to print changes");
+		add_text (&c->answer, "error unknown command %s\n", c->command);
 	}
+	write_answer (c);
+}
 
-	/* Forward buffer content to syslog. */
-	forward (f->name, (long) nbytes, buffer);
+/* Read the command of a client, up to the end of the line or of what
+   it writes. */
 
-	/* Finish. */
-	free (buffer);
-	status = close (fd);
-	if (status == -1)
+void
+read_command (client_t *c)
+{
+	char *nl;
+	ssize_t n;
+
+	n = recv (c->fd, c->command + c->length,
+		(size_t) (COMMAND_MAX - 1 - c->length), MSG_DONTWAIT);
+	if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
 	{
-		fprintf (stderr, "Error closing %s\n", f->name);
-		perror ("Error context");
-		error ("Cannot close");
+		return;
+	}
+	if (n == -1)
+	{
+		close_client (c);
+		return;
+	}
+	c->length += (int) n;
+	nl = memchr (c->command, NL, (size_t) c->length);
+	if (nl != NULL)
+	{
+		c->length = (int) (nl - c->command);
+	}
+	if (nl != NULL || n == 0 || c->length == COMMAND_MAX - 1)
+	{
+		run_command (c);
 	}
-	f->fd = -1;
 }
 
-/* Insert matching file into the global file table. */
+/* Take the clients connecting. When all entries are taken the ones
+   that took too long are dropped, otherwise the new one is. */
 
 void
-insert_matching (char *pattern, char *exclude, char *filename)
+accept_clients (void)
 {
-	if ((pattern == NULL) || (exclude == NULL))
+	time_t now;
+	int fd;
+	int i;
+
+	while ((fd = accept4 (controlfd, NULL, NULL,
+		SOCK_NONBLOCK|SOCK_CLOEXEC)) != -1)
 	{
-		printf ("Excluded %s on null pattern\n", filename);
-		return;
+		now = time (NULL);
+		for (i=0; i<CLIENTS_MAX; i++)
+		{
+			if (clients[i].fd != -1 &&
+				now - clients[i].since > CLIENT_TIMEOUT)
+			{
+				close_client (&clients[i]);
+			}
+		}
+		for (i=0; i<CLIENTS_MAX && clients[i].fd != -1; i++)
+		{
+		}
+		if (i == CLIENTS_MAX)
+		{
+			(void) close (fd);
+			continue;
+		}
+		clients[i].fd = fd;
+		clients[i].since = now;
+		watch_fd (fd, EPOLLIN);
 	}
-	if (match (pattern, filename))
+}
+
+/* Event on the connection of a client. Return whether it is one. */
+
+int
+client_event (int fd)
+{
+	int i;
+
+	for (i=0; i<CLIENTS_MAX; i++)
 	{
-		if (strcmp (exclude, "") != 0)
+		if (clients[i].fd == fd)
 		{
-			if (match (exclude, filename))
+			if (clients[i].answer.used > 0)
 			{
-				if (verbose)
-				{
-					printf ("Excluded %s with %s\n", filename, exclude);
-				}
+				write_answer (&clients[i]);
 			}
 			else
 			{
-				if (verbose)
-				{
-					printf ("Matched %s with %s\n", filename, pattern);
-				}
-				put_file (filename);
+				read_command (&clients[i]);
 			}
-		}
-		else
-		{
-				if (verbose)
-				{
-					printf ("Matched %s with %s no exclude\n",
-						filename, pattern);
-				}
-				put_file (filename);
+			return (true);
 		}
 	}
+	return (false);
 }
 
-/* Scan directory tree. */
+/* Ask the daemon running with the same log directory on its control
+   socket and print the answer. */
 
 void
-scan (char *pattern, char *exclude, char *path)
+query_control (char *command)
 {
-	extern int errno;
-	DIR *d;
-	struct dirent *e;
-	char *current;
-	char filename[PATH_MAX+1];
-	int dotty;
-	int status;
-
-	/* Error would be returned here. */
-	errno = 0;
+	struct sockaddr_un addr;
+	struct timeval tv;
+	char path[PATH_MAX+1];
+	char buffer[4096];
+	ssize_t n;
+	int fd;
 
-	/* Check. */
-	if (! directory (path))
+	state_path (path, CONTROL_NAME);
+	if (strlen (path) >= sizeof (addr.sun_path))
 	{
-		error ("Not a directory");
+		(void) fprintf (stderr, "Control socket path %s too long\n", path);
+		exit (FAILURE);
 	}
-
-	/* Open directory. */
-	d = opendir (path);
-	if (d == NULL)
+	(void) memset (&addr, 0, sizeof (addr));
+	addr.sun_family = AF_UNIX;
+	(void) strcpy (addr.sun_path, path);
+	fd = socket (AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+	if (fd == -1 ||
+		connect (fd, (struct sockaddr *) &addr, sizeof (addr)) == -1)
 	{
-		(void) fprintf (stderr, "Error opening directory %s\n", path);
-		error ("Cannot open directory");
+		perror ("Error context");
+		(void) fprintf (stderr, "Cannot connect to %s\n", path);
+		exit (FAILURE);
 	}
 
-	/* Read directory entries. */
-	e = readdir (d);
-	if (e == NULL && errno != 0)
+	/* A daemon held up, as by a target not taking the messages, does
+	   not keep the caller waiting for long. */
+	tv.tv_sec = CLIENT_TIMEOUT;
+	tv.tv_usec = 0;
+	(void) setsockopt (fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof (tv));
+	(void) snprintf (buffer, sizeof (buffer), "%s\n", command);
+	if (write (fd, buffer, strlen (buffer)) == -1)
+	{
+		perror ("Error context");
+		error ("Cannot send the command");
+	}
+	while ((n = read (fd, buffer, sizeof (buffer))) > 0)
 	{
-		error ("Error scanning directory");
+		(void) fwrite (buffer, (size_t) 1, (size_t) n, stdout);
 	}
-	while (e != NULL)
+	if (n == -1)
 	{
+		perror ("Error context");
+		(void) fprintf (stderr, "No answer from %s\n", path);
+		exit (FAILURE);
+	}
+	(void) close (fd);
+	exit (SUCCESS);
+}
 
-		/* Processing one entry. Create a copy of the name. */
-		current = strdup (e->d_name);
-		*filename = EOS;
-		(void) strcat (filename, path);
-		(void) strcat (filename, "/");
-		(void) strcat (filename, current);
-
-		/* Create file entry if it is a real file. */
-		if (realname (filename))
-		{
-			if (! directory (filename))
-			{
-				insert_matching (pattern, exclude, filename);
-			}
-		}
-
-		/* Descend if it is a real directory. */
-		if (directory (filename))
-		{
-			dotty = (strcmp (current, ".") == 0) ||
-				(strcmp (current, "..") == 0);
-			if (! dotty)
-			{
-				scan (pattern, exclude, filename);
-			}
-		}
-
-		free (current);
+/* Convert a time on the wall clock, in seconds, to milliseconds on the
+   monotonic clock. */
 
-		/* Get next entry. */
-		e = readdir (d);
-		if (e == NULL && errno != 0)
-		{
-			error ("Error scanning directory");
-		}
-	}
+unsigned long
+monotonic_ms (time_t when, unsigned long now)
+{
+	time_t wall;
 
-	/* List exhausted, finish. */
-	status = closedir (d);
-	if (status != 0)
+	wall = time (NULL);
+	if (when <= wall)
 	{
-		error ("Error closing directory");
+		return (now);
 	}
+	return (now + (unsigned long) (when - wall) * 1000UL);
 }
 
-/* Scan directory tree or insert single file. */
+/* Print the status, asked for with USR1. */
 
 void
-put_entry (char *pattern, char *exclude, char *name)
+print_status (void)
 {
-	if (directory (name))
+	print_configuration ();
+	if (target != NULL)
 	{
-		if (verbose)
-		{
-			printf ("Scanning %s\n", name);
-		}
-		scan (pattern, exclude, name);
+		printf ("Messages sent %lu, dropped %lu\n", sink.sent, sink.dropped);
 	}
-	else
+	print_spool ();
+	print_ring ();
+	print_catalog ();
+	(void) fflush (stdout);
+}
+
+/* Remove all entries. */
+
+void
+remove_all_entries ()
+{
+	int i;
+
+	for (i=0; i<nslots; i++)
 	{
-		insert_matching (pattern, exclude, name);
+		remove_entry (i);
 	}
 }
 
-/* Check file catalog. */
+/* Shut down as asked by a signal. What is batched is sent and the
+   offsets are saved. */
 
 void
-check_catalog (void)
+shut_down (int sig)
 {
-	int i;
+	fprintf (stderr, "Signal %s received shutting down\n", strsignal (sig));
+	if (sinktype != SINK_SYSLOG)
+	{
+		flush_sink ();
+	}
+	if (progress)
+	{
+		write_checkpoint ();
+	}
 
-	for (i=0; i<FILES_MAX; i++)
+	if (metricsfile != NULL)
 	{
-		if (files[i] != NULL)
-		{
-			if (files[i]->sn != -1)
-			{
-				if (check_file (files[i]))
-				{
-					if (verbose)
-					{
-						printf ("Changed %s\n", files[i]->name);
-					}
-					print_file_change (files[i]);
-				}
-			}
-		}
+		write_metrics ();
 	}
+
+	/* Remove all entries in the file table. */
+	remove_all_entries ();
+	close_control ();
+
+	/* Make syslog entry. */
+	log_message ("Closing log and shutting down");
+
+	/* Close syslog facility. */
+	closelog ();
+
+	/* Finish here. */
+	exit (SUCCESS);
 }
 
-/* Signal handler for HUP. */
+/* Set up the event loop. The signals handled are blocked and read from
+   a descriptor, so they are handled in the loop like any other event,
+   before the threads are started, which inherit the mask. */
 
 void
-handlehup (int sig)
+init_events (void)
 {
-	fprintf (stderr, "Signal SIGHUP received and ignored\n");
+	sigset_t mask;
+
+	(void) sigemptyset (&mask);
+	(void) sigaddset (&mask, SIGHUP);
+	(void) sigaddset (&mask, SIGINT);
+	(void) sigaddset (&mask, SIGQUIT);
+	(void) sigaddset (&mask, SIGTERM);
+	(void) sigaddset (&mask, SIGUSR1);
+	(void) sigprocmask (SIG_BLOCK, &mask, NULL);
+	epollfd = epoll_create1 (EPOLL_CLOEXEC);
+	timerfd = timerfd_create (CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC);
+	signalsfd = signalfd (-1, &mask, SFD_NONBLOCK|SFD_CLOEXEC);
+	if (epollfd == -1 || timerfd == -1 || signalsfd == -1)
+	{
+		perror ("Error context");
+		error ("Cannot set up the event loop");
+	}
+	watch_fd (timerfd, EPOLLIN);
+	watch_fd (signalsfd, EPOLLIN);
+	if (notifyfd != -1)
+	{
+		watch_fd (notifyfd, EPOLLIN);
+	}
 }
 
-/* Signal handler for USR1. */
+/* Set the timer to the deadline, milliseconds on the monotonic clock,
+   ULONG_MAX for none. */
 
 void
-handleusr1 (int sig)
+set_timer (unsigned long deadline)
 {
+	struct itimerspec its;
 
-	/* Print configuration. */
-	print_configuration ();
-	print_catalog ();
-	(void) fsync (fileno (stdout));
-	(void) sleep ((unsigned int) 1);
+	(void) memset (&its, 0, sizeof (its));
+	if (deadline != ULONG_MAX)
+	{
+		its.it_value.tv_sec = (time_t) (deadline / 1000UL);
+		its.it_value.tv_nsec = (long) (deadline % 1000UL) * 1000000L + 1L;
+	}
+	if (timerfd_settime (timerfd, TFD_TIMER_ABSTIME, &its, NULL) == -1)
+	{
+		perror ("Error context");
+		error ("Cannot set timer");
+	}
 }
 
-/* Remove all entries. */
+/* Read the signals arrived. Return the one asking to shut down, zero if
+   none did. */
 
-void
-remove_all_entries ()
+int
+read_signals (void)
 {
-	int i;
-	file_t *f;
+	struct signalfd_siginfo si;
+	int sig;
 
-	for (i=0; i<FILES_MAX; i++)
+	sig = 0;
+	while (read (signalsfd, &si, sizeof (si)) == (ssize_t) sizeof (si))
 	{
-		remove_entry (i);
+		switch (si.ssi_signo)
+		{
+		case SIGUSR1:
+			print_status ();
+			break;
+		case SIGHUP:
+			fprintf (stderr, "Signal SIGHUP received and ignored\n");
+			break;
+		default:
+			sig = (int) si.ssi_signo;
+			break;
+		}
 	}
+	return (sig);
 }
 
-/* Signal handler for exit. */
+/* Event on the connection to the target, with the events given. A
+   connection being made is finished, one the target takes data on again
+   is written to, one closed by the other end is noticed before more is
+   written to it and lost. */
 
 void
-handleexit (int sig)
+sink_event (uint32_t events)
 {
+	char discard[256];
+	socklen_t len;
+	ssize_t n;
+	int err;
 
-	/* SIGHUP or SIGQUIT received. */
-	fprintf (stderr, "Signal received shutting down\n");
+	if (sink.connecting)
+	{
+		err = 0;
+		len = sizeof (err);
+		(void) getsockopt (sink.fd, SOL_SOCKET, SO_ERROR, &err, &len);
+		if (err == 0)
+		{
+			connected_sink ();
+		}
+		else
+		{
+			connect_failed (err);
+		}
+		return;
+	}
 
-	/* Remove all entries in the file table. */
-	remove_all_entries ();
+	/* The target takes data again, send what waits. A datagram socket
+	   is watched once, an error shows when sending. */
+	if (sink.blocked && ((events & EPOLLOUT) || sinktype == SINK_DGRAM))
+	{
+		sink_writable ();
+		flush_sink ();
+	}
+	if (sinktype != SINK_STREAM || sink.fd == -1 ||
+		(events & ~EPOLLOUT) == 0)
+	{
+		return;
+	}
+	do
+	{
+		n = recv (sink.fd, discard, sizeof (discard), MSG_DONTWAIT);
+	}
+	while (n > 0);
+	if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+	{
+		(void) fprintf (stderr, "Connection to %s closed\n", target);
+		(void) close (sink.fd);
+		sink.fd = -1;
+		sink.blocked = false;
+		atomic_store (&sinkbusy, false);
+		drop_written ();
+		sink.done = 0;
+	}
+}
 
-	/* Make syslog entry. */
-	syslog (LOG_INFO, "%s", "Closing log and shutting down");
+/* Wait for events until the deadline, milliseconds on the monotonic
+   clock, ULONG_MAX for none, and handle them. Return the signal asking
+   to shut down, zero if none did. */
 
-	/* Close syslog facility. */
-	closelog ();
+int
+wait_events (unsigned long deadline)
+{
+	struct epoll_event events[EVENTS_MAX];
+	uint64_t expirations;
+	int sig;
+	int n;
+	int i;
 
-	/* Finish here. */
-	exit (SUCCESS);
+	set_timer (deadline);
+	n = epoll_wait (epollfd, events, EVENTS_MAX, -1);
+	if (n == -1)
+	{
+		if (errno != EINTR)
+		{
+			perror ("Error context");
+			error ("Error waiting for events");
+		}
+		return (0);
+	}
+	sig = 0;
+	for (i=0; i<n; i++)
+	{
+		if (events[i].data.fd == timerfd)
+		{
+			(void) read (timerfd, &expirations, sizeof (expirations));
+		}
+		else if (events[i].data.fd == signalsfd)
+		{
+			sig = read_signals ();
+		}
+		else if (events[i].data.fd == notifyfd)
+		{
+			read_notify ();
+		}
+		else if (events[i].data.fd == sink.fd)
+		{
+			sink_event (events[i].events);
+		}
+		else if (events[i].data.fd == controlfd)
+		{
+			accept_clients ();
+		}
+		else
+		{
+			(void) client_event (events[i].data.fd);
+		}
+	}
+	return (sig);
 }
 
 /* Daemonize. */
@@ -1253,11 +7469,7 @@ daemonize (void)
 	(void) signal (SIGTTOU, SIG_IGN);
 	(void) signal (SIGTTIN, SIG_IGN);
 
-	/* Setup for hangup and term signals. */
-	(void) signal (SIGHUP, handlehup);
-	(void) signal (SIGTERM, handleexit);
-	(void) signal (SIGQUIT, handleexit);
-	(void) signal (SIGUSR1, handleusr1);
+	/* Hangup, term and status signals are handled in the event loop. */
 }
 
 /* Build file table. */
@@ -1267,9 +7479,10 @@ build_table (char *cwd, int argc, char *argv[])
 {
 	char *pattern;
 	char *exclude;
-	time_t starttime;
-	time_t endtime;
-	time_t elapsed;
+	unsigned long starttime;
+	unsigned long walktime;
+	unsigned long endtime;
+	long count;
 	int i;
 	char *name;
 	int found_entry;
@@ -1281,11 +7494,14 @@ build_table (char *cwd, int argc, char *argv[])
 	/* Not excluding by default. */
 	exclude = "";
 
-	/* Number of files inserted. */
-	nfiles = 0;
-
-	/* Mark start. */
-	(void) time (&starttime);
+	/* Mark start. The patterns are compiled first, then the trees are
+	   scanned by as many threads as there are processors, up to a
+	   limit. */
+	starttime = now_ns ();
+	compile_patterns (argc, argv);
+	count = sysconf (_SC_NPROCESSORS_ONLN);
+	init_scan ((count < 1) ? 1 : (count > SCANNERS_MAX) ? SCANNERS_MAX :
+		(int) count, true);
 
 	/* Process the args. */
 	found_entry = false;
@@ -1339,6 +7555,11 @@ build_table (char *cwd, int argc, char *argv[])
 		}
 	}
 
+	/* Scan the trees, then register what was found. */
+	walk_scan ();
+	walktime = now_ns ();
+	register_scan ();
+
 	/* Check. */
 	if (! found_entry)
 	{
@@ -1346,12 +7567,37 @@ build_table (char *cwd, int argc, char *argv[])
 	}
 
 	/* Finish. */
+	endtime = now_ns ();
+	scantime = endtime - starttime;
 	if (verbose)
 	{
 		printf ("Watching %d files\n", nfiles);
-		(void) time (&endtime);
-		elapsed = endtime - starttime;
-		printf ("Scan took %d second(s)\n", (int) elapsed);
+		printf ("Walking took %.3f second(s)\n",
+			(double) (walktime - starttime) / 1e9);
+		printf ("Registering took %.3f second(s)\n",
+			(double) (endtime - walktime) / 1e9);
+		printf ("Scan took %.3f second(s)\n",
+			(double) (endtime - starttime) / 1e9);
+	}
+}
+
+/* Get rate limit as lines[:bytes] per second. */
+
+void
+get_rate (char *arg, double *lines, double *bytes)
+{
+	char *end;
+
+	*lines = strtod (arg, &end);
+	*bytes = 0.0;
+	if (*end == ':')
+	{
+		*bytes = strtod (end + 1, &end);
+	}
+	if (end == arg || *end != EOS || *lines < 0.0 || *bytes < 0.0)
+	{
+		(void) fprintf (stderr, "Rate limit is %s\n", arg);
+		error ("Rate limit should be lines[:bytes] per second");
 	}
 }
 
@@ -1365,18 +7611,42 @@ This program runs in the background as a daemon and\n\
 watches files. Forwards lines as they are appended to\n\
 these files to the syslog facility.\n\
 Usage:\n\
-    logforw [-v][-d][-s delay][-l logfile] [-p pattern][-x pattern] name...\n\
+    logforw [-v][-d][-n][-X][-s delay][-o count][-w count][-f facility]\n\
+        [-c code][-t target][-r rfc][-S size][-q rate][-Q rate]\n\
+        [-m lag][-M file][-l logfile]\n\
+        [-p pattern][-x pattern] name...\n\
         [[-p pattern][-x pattern] name...]\n\
+    logforw [-l logfile] -C command\n\
 where\n\
     -v          to print verbose messages\n\
     -d          debug mode, do not daemonize, run in the foreground\n\
-    -s seconds  sleep delay in seconds\n\
-    -f facility is the facility code to use with syslog\n\
+    -n          no change notification, poll all files\n\
+    -X          do not descend into other file systems when scanning\n\
+    -s seconds  sleep delay in seconds, the longest interval a file\n\
+                that changed lately is polled at\n\
+    -o count    number of files kept open, the default is 256\n\
+    -w count    number of threads reading the files, the default is 1\n\
+    -f facility is the facility name to use with syslog\n\
+    -c code     is the facility code, local7 by default\n\
+    -t target   send to syslog directly in batches, target is\n\
+                unix:path as unix:/dev/log, udp:host:port or\n\
+                tcp:host:port\n\
+    -r rfc      message format for the target, 3164 or 5424\n\
+    -S size     spool file size in bytes, keeps the messages for the\n\
+                target while it cannot take them\n\
+    -q rate     rate limit per file as lines[:bytes] per second\n\
+    -Q rate     rate limit for all files as lines[:bytes] per second\n\
+    -m lag      bytes a file may lag behind before lines are dropped\n\
+    -M file     metrics file rewritten every 10 seconds, in the\n\
+                Prometheus text format\n\
     -l logfile  log file to use, the default is\n\
                 /var/tmp/logforw/logforw.log.\n\
                 The directory for the log files needs to be created\n\
                 beforehand.\n\
                 It should be owned by userid the daemon is running under.\n\
+    -C command  ask the daemon running with the same log file on its\n\
+                control socket, logforw.sock next to the log file, and\n\
+                print the answer. The command is status or metrics.\n\
     -p pattern  is a pattern to match against the file names.\n\
     -x pattern  is a pattern to exclude files.\n\
     name        is the name of a file or a directory. If a directory is\n\
@@ -1397,8 +7667,20 @@ main (int argc, char *argv[])
 	char *arg;
 	char *pattern;
 	char *exclude;
+	char *query;
 	char cwdbuf[PATH_MAX+1];
+	char metricsbuf[PATH_MAX+1];
 	char *cwd;
+	unsigned long deadline;
+	unsigned long wake;
+	unsigned long rescantime;
+	unsigned long now;
+	time_t checkpointtime;
+	time_t metricstime;
+	int polling;
+	int polled;
+	int sig;
+	reader_t reader;
 
 	/* Check, we'll need enough arguments. */
 	if (argc <= 1)
@@ -1417,6 +7699,7 @@ main (int argc, char *argv[])
 	delayseconds = SLEEP_DELAY;
 	pattern = DEFAULT_PATTERN;
 	exclude = NULL;
+	query = NULL;
 	for (i=1; i<argc; i++)
 	{
 		arg = argv[i];
@@ -1463,6 +7746,56 @@ main (int argc, char *argv[])
 			/* Move to the next. */
 			i++;
 		}
+		else if (eqs (arg, "-c") || eqs (arg, "--code"))
+		{
+
+			/* Get facility code. */
+			facilitycode = get_facility (argv[i+1]);
+
+			/* Invalidate the argument which is a switch. */
+			argv[i] = NULL;
+
+			/* Also the next one which is the facilty code. */
+			argv[i+1] = NULL;
+
+			/* Move to the next. */
+			i++;
+		}
+		else if (eqs (arg, "-t") || eqs (arg, "--target"))
+		{
+
+			/* Send directly to the target. */
+			target = argv[i+1];
+			sinktype = SINK_DGRAM;
+
+			/* Invalidate the argument which is a switch. */
+			argv[i] = NULL;
+
+			/* Also the next one which is the target. */
+			argv[i+1] = NULL;
+
+			/* Move to the next. */
+			i++;
+		}
+		else if (eqs (arg, "-r") || eqs (arg, "--rfc"))
+		{
+
+			/* Message format for the direct transport. */
+			rfcformat = atoi (argv[i+1]);
+			if (rfcformat != 3164 && rfcformat != 5424)
+			{
+				error ("Format should be 3164 or 5424");
+			}
+
+			/* Invalidate the argument which is a switch. */
+			argv[i] = NULL;
+
+			/* Also the next one which is the format. */
+			argv[i+1] = NULL;
+
+			/* Move to the next. */
+			i++;
+		}
 		else if (eqs (arg, "-l") || eqs (arg, "--logfilename"))
 		{
 
@@ -1487,6 +7820,166 @@ main (int argc, char *argv[])
 			/* Invalidate the argument which is a switch. */
 			argv[i] = NULL;
 		}
+		else if (eqs (arg, "-X") || eqs (arg, "--xdev"))
+		{
+
+			/* Stay on the file system of the scanned name. */
+			samefs = true;
+
+			/* Invalidate the argument which is a switch. */
+			argv[i] = NULL;
+		}
+		else if (eqs (arg, "-o") || eqs (arg, "--openfiles"))
+		{
+
+			/* Budget of descriptors kept open. */
+			openfiles = atoi (argv[i+1]);
+			if (openfiles <= 0)
+			{
+				error ("Value error for atoi");
+			}
+
+			/* Invalidate the argument which is a switch. */
+			argv[i] = NULL;
+
+			/* Invalidate the argument to the switch. */
+			argv[i+1] = NULL;
+
+			/* Move to the next. */
+			i++;
+		}
+		else if (eqs (arg, "-w") || eqs (arg, "--workers"))
+		{
+
+			/* Number of reader threads. */
+			nworkers = atoi (argv[i+1]);
+			if (nworkers <= 0)
+			{
+				error ("Value error for atoi");
+			}
+
+			/* Invalidate the argument which is a switch. */
+			argv[i] = NULL;
+
+			/* Invalidate the argument to the switch. */
+			argv[i+1] = NULL;
+
+			/* Move to the next. */
+			i++;
+		}
+		else if (eqs (arg, "-q") || eqs (arg, "--filerate"))
+		{
+
+			/* Rate limit per file. */
+			get_rate (argv[i+1], &filelines, &filebytes);
+
+			/* Invalidate the argument which is a switch. */
+			argv[i] = NULL;
+
+			/* Invalidate the argument to the switch. */
+			argv[i+1] = NULL;
+
+			/* Move to the next. */
+			i++;
+		}
+		else if (eqs (arg, "-Q") || eqs (arg, "--rate"))
+		{
+
+			/* Rate limit for all files. */
+			get_rate (argv[i+1], &globallines, &globalbytes);
+
+			/* Invalidate the argument which is a switch. */
+			argv[i] = NULL;
+
+			/* Invalidate the argument to the switch. */
+			argv[i+1] = NULL;
+
+			/* Move to the next. */
+			i++;
+		}
+		else if (eqs (arg, "-m") || eqs (arg, "--maxlag"))
+		{
+
+			/* Lag after which lines are dropped. */
+			maxlag = (off_t) atol (argv[i+1]);
+			if (maxlag <= 0)
+			{
+				error ("Value error for atol");
+			}
+
+			/* Invalidate the argument which is a switch. */
+			argv[i] = NULL;
+
+			/* Invalidate the argument to the switch. */
+			argv[i+1] = NULL;
+
+			/* Move to the next. */
+			i++;
+		}
+		else if (eqs (arg, "-S") || eqs (arg, "--spool"))
+		{
+
+			/* Size of the spool file. */
+			spoolsize = (size_t) atol (argv[i+1]);
+			if (spoolsize < (size_t) 1048576)
+			{
+				error ("Spool size should be at least 1048576 bytes");
+			}
+
+			/* Invalidate the argument which is a switch. */
+			argv[i] = NULL;
+
+			/* Invalidate the argument to the switch. */
+			argv[i+1] = NULL;
+
+			/* Move to the next. */
+			i++;
+		}
+		else if (eqs (arg, "-n") || eqs (arg, "--nonotify"))
+		{
+
+			/* Poll all files, do not use change notification. */
+			notify = false;
+
+			/* Invalidate the argument which is a switch. */
+			argv[i] = NULL;
+		}
+		else if (eqs (arg, "-M") || eqs (arg, "--metrics"))
+		{
+
+			/* Metrics file. */
+			metricsfile = argv[i+1];
+
+			/* Invalidate the argument which is a switch. */
+			argv[i] = NULL;
+
+			/* Invalidate the argument to the switch. */
+			argv[i+1] = NULL;
+
+			/* Move to the next. */
+			i++;
+		}
+		else if (eqs (arg, "-C") || eqs (arg, "--control"))
+		{
+
+			/* Ask the running daemon instead. */
+			query = argv[i+1];
+
+			/* Invalidate the argument which is a switch. */
+			argv[i] = NULL;
+
+			/* Invalidate the argument to the switch. */
+			argv[i+1] = NULL;
+
+			/* Move to the next. */
+			i++;
+		}
+	}
+
+	/* Query the running daemon if asked. */
+	if (query != NULL)
+	{
+		query_control (query);
 	}
 
 	/* Print config and arguments if asked. */
@@ -1530,6 +8023,12 @@ main (int argc, char *argv[])
 	{
 		error ("Cannot obtain current working directory path");
 	}
+	if (metricsfile != NULL && *metricsfile != '/')
+	{
+		(void) snprintf (metricsbuf, sizeof (metricsbuf), "%s/%s", cwd,
+			metricsfile);
+		metricsfile = metricsbuf;
+	}
 
 	/* Daemonize. */
 	if (background)
@@ -1547,33 +8046,108 @@ main (int argc, char *argv[])
 		printf ("Starting up\n");
 	}
 	init_file ();
+	init_notify ();
+	init_events ();
+	init_counters ((nworkers > 1) ? nworkers + 1 : 1);
+	(void) memset (&reader, 0, sizeof (reader));
+	reader.counters = &counters[0];
+	start_workers ();
 
 	/* Prepare for logging. */
-	openlog (facility, (int) 0, LOG_LOCAL7);
+	openlog (facility, (int) 0, facilitycode);
+	open_sink ();
+	open_control ();
 
 	/* Make syslog entry about startup. */
-	syslog (LOG_INFO, "%s", "Starting up");
-	delay (delayseconds);
+	log_message ("Starting up");
 
 	/* Build table with files. */
 	if (verbose)
 	{
 		printf ("Building file table\n");
 	}
+	read_checkpoint ();
 	build_table (cwd, argc, argv);
-
-	/* Main cycle. */
+	forget_checkpoint ();
+	(void) reserve (&statebuffer, &statebuffersize, sizeof (statehead_t) +
+		(size_t) nfiles * sizeof (staterecord_t));
+	started = true;
+	checkpointtime = time (NULL) + CHECKPOINT_INTERVAL;
+	metricstime = time (NULL);
+
+	/* Main cycle. Changes notified are handled as they arrive, files
+	   without notification are polled as they are due and directories
+	   without notification after each delay. In between the process
+	   sleeps until an event or the earliest of its deadlines. */
+	rescantime = now_ms () + (unsigned long) delayseconds * 1000UL;
+	nextpoll = now_ms ();
+	polled = true;
 	while (true)
 	{
 
-		/* Check catalog. */
-		check_catalog ();
+		/* Wait for changes, for the next file due, for the directories
+		   to poll, for the files held back, for the checkpoint or for
+		   the target to take what is waiting. */
+		now = now_ms ();
+		deadline = nextpoll;
+		if (polled && rescantime < deadline)
+		{
+			deadline = rescantime;
+		}
+		if (throttled && now + THROTTLE_WAIT < deadline)
+		{
+			deadline = now + THROTTLE_WAIT;
+		}
+		if (progress)
+		{
+			wake = monotonic_ms (checkpointtime, now);
+			deadline = (wake < deadline) ? wake : deadline;
+		}
+		if (metricsfile != NULL)
+		{
+			wake = monotonic_ms (metricstime, now);
+			deadline = (wake < deadline) ? wake : deadline;
+		}
+		if (sink.connecting)
+		{
+			wake = monotonic_ms (sink.connectby, now);
+			deadline = (wake < deadline) ? wake : deadline;
+		}
+		else if (sinktype != SINK_SYSLOG && ! sink.blocked &&
+			(sink.used > 0 || sink.count > 0 || spool_pending ()))
+		{
+			wake = monotonic_ms (sink.retry, now);
+			deadline = (wake < deadline) ? wake : deadline;
+		}
+		if ((sig = wait_events (deadline)) != 0)
+		{
+			shut_down (sig);
+		}
+		now = now_ms ();
+		polling = (now >= rescantime);
 
-		/* Rescan files. */
-		build_table (cwd, argc, argv);
+		/* Pick up new and renamed files from the directories that
+		   changed. */
+		polled = update_table (polling);
 
-		/* Wait. */
-		delay (delayseconds);
+		/* Check catalog. */
+		check_catalog (&reader, now);
+
+		/* Save the offsets now and then. */
+		if (progress && time (NULL) >= checkpointtime)
+		{
+			write_checkpoint ();
+			checkpointtime = time (NULL) + CHECKPOINT_INTERVAL;
+		}
+		if (metricsfile != NULL && time (NULL) >= metricstime)
+		{
+			write_metrics ();
+			metricstime = time (NULL) + METRICS_INTERVAL;
+		}
+		if (polling)
+		{
+			rescantime = now + (unsigned long) delayseconds * 1000UL;
+		}
 	}
 
 	/* Finish. Never called. */